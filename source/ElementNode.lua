@@ -1,129 +1,186 @@
 -- vim: ft=lua ts=2
-local Set = {}
-Set.mt = {__index = Set}
-function Set:new(values)
-	local instance = {}
-	local isSet if getmetatable(values) == Set.mt then isSet = true end
-	if type(values) == "table" then
-		if not isSet and #values > 0 then
-			for _,v in ipairs(values) do
-				instance[v] = true
-			end
-		else
-			for k in pairs(values) do
-				instance[k] = true
-			end
-		end
-	elseif values ~= nil then
-		instance = {[values] = true}
+-- A parsed document is stored as parallel arrays indexed by element number (0 is the root), held by the root node:
+-- name, parent, first child, next sibling, open/close tag positions, first text span and a range of a shared
+-- attribute list. Elements are only turned into ElementNode tables when asked for, as views on those arrays.
+local ElementNode = {}
+
+-- Tag and attribute names are interned: each distinct name gets a small number, shared by all documents,
+-- so the arrays hold numbers and comparing names is comparing numbers
+local symbols, symbolids, lowercase = {}, {}, {}
+local function intern(name)
+	local id = symbolids[name]
+	if not id then
+		id = #symbols + 1
+		symbols[id] = name
+		symbolids[name] = id
+		local lower = string.lower(name)
+		lowercase[id] = lower == name and id or intern(lower)
 	end
-	return setmetatable(instance, Set.mt)
+	return id
 end
+ElementNode.intern = intern
+ElementNode.symbols = symbols -- number -> name
+ElementNode.symbolids = symbolids -- name -> number
+ElementNode.lowercase = lowercase -- number -> number of the lowercased name
+local idkey, classkey = intern("id"), intern("class")
+
+local fields = {} -- element properties computed from the document arrays, by name
+ElementNode.mt = {__index = function(node, key)
+	local method = ElementNode[key]
+	if method then return method end
+	local field = fields[key]
+	if field then return field(node, node.root, node.index) end
+end}
 
-function Set:add(e)
-	if e ~= nil then self[e] = true end
-	return self
+-- The view of element i, the same table for as long as anyone holds on to it
+local function view(root, i)
+	if i == 0 then return root end
+	local views = root._views
+	local node = views[i]
+	if not node then
+		node = setmetatable({root = root, index = i}, ElementNode.mt)
+		views[i] = node
+	end
+	return node
 end
 
-function Set:remove(e)
-	if e ~= nil then self[e] = nil end
-	return self
+-- Attribute values are stored as positions in the document; the string is made (once) when first asked for
+local function attributevalue(root, a)
+	local value = root._attrvalues[a]
+	if not value then
+		value = string.sub(root._text, root._attrstarts[a], root._attrends[a])
+		root._attrvalues[a] = value
+	end
+	return value
 end
 
-function Set:tolist()
-	local res = {}
-	for k in pairs(self) do
-		table.insert(res, k)
+-- Slot in the attribute list of attribute number k of element i (the last one, if repeated)
+local function attributeslot(root, i, k)
+	local keys = root._attrkeys
+	for a = root._attrlast[i], root._attrfirst[i], -1 do
+		if keys[a] == k then return a end
 	end
-	return res
+	return nil
 end
 
-Set.mt.__add = function (a, b)
-	local res, a, b = Set:new(), Set:new(a), Set:new(b)
-	for k in pairs(a) do res[k] = true end
-	for k in pairs(b) do res[k] = true end
-	return res
+-- Value of attribute number k of element i
+local function attribute(root, i, k)
+	local a = attributeslot(root, i, k)
+	return a and attributevalue(root, a)
 end
 
--- Subtraction
-Set.mt.__sub = function (a, b)
-	local res, a, b = Set:new(), Set:new(a), Set:new(b)
-	for k in pairs(a) do res[k] = true end
-	for k in pairs(b) do res[k] = nil end
-	return res
+function fields.name(node, root, i) return symbols[root._names[i]] end
+function fields.id(node, root, i) return root._ids[i] end
+function fields._openstart(node, root, i) return root._openstarts[i] end
+function fields._openend(node, root, i) return root._openends[i] end
+function fields._closestart(node, root, i) return root._closestarts[i] end
+function fields._closeend(node, root, i) return root._closeends[i] end
+function fields._textfirst(node, root, i) return root._textfirsts[i] end
+
+function fields.parent(node, root, i)
+	local p = root._parents[i]
+	return p and view(root, p)
 end
 
--- Intersection
-Set.mt.__mul = function (a, b)
-	local res, a, b = Set:new(), Set:new(a), Set:new(b)
-	for k in pairs(a) do
-		res[k] = b[k]
+function fields.level(node, root, i)
+	local level, p = 0, root._parents[i]
+	while p do
+		level = level + 1
+		p = root._parents[p]
 	end
-	return res
+	return level
 end
 
--- String representation
-Set.mt.__tostring = function (set)
-	local list = {"{"}
-	for k in pairs(set) do
-		list[#list + 1] = tostring(k)
-		list[#list + 1] = ", " -- <= Theoretically, it should't be a problem because of string buffering.
-					-- Especially, as it allows to avoid string concatenation at all, and also allows to 
-					-- avoid things like [1]
-					-- it looks like good idea to add separators this way.
-					-- But it needs to be tested on real-world examples with giant inputs.
-					-- If any (if it'd show that string buffering fails, and it is still leads huge RAM usage),
-					-- it can be downgraded to [1] or even string.format
-					--
-					-- [1] = something like table.concat{"{",table.concat(list,","),"}"},
-					--
+function fields.nodes(node, root, i)
+	local nodes, nextsibling = {}, root._nextsibling
+	local child = root._firstchild[i]
+	while child do
+		nodes[#nodes + 1] = view(root, child)
+		child = nextsibling[child]
 	end
-	list[#list] = "}"
-
-	return table.concat(list)
+	rawset(node, "nodes", nodes)
+	return nodes
 end
 
+function fields.attributes(node, root, i)
+	local attributes, keys = {}, root._attrkeys
+	for a = root._attrfirst[i], root._attrlast[i] do
+		attributes[symbols[keys[a]]] = attributevalue(root, a)
+	end
+	rawset(node, "attributes", attributes)
+	return attributes
+end
 
+-- class attribute contains "space-separated tokens", each of which we'd like quick access to
+function fields.classes(node, root, i)
+	local classes = {}
+	for class in string.gmatch(root._classes[i] or "", "%S+") do
+		table.insert(classes, class)
+	end
+	rawset(node, "classes", classes)
+	return classes
+end
 
-local ElementNode = {}
-ElementNode.mt = {__index = ElementNode}
-function ElementNode:new(index, nameortext, node, descend, openstart, openend)
-	local instance = {
-		index = index,
-		name = nameortext,
-		level = 0,
-		parent = nil,
-		root = nil,
-		nodes = {},
-		_openstart = openstart, _openend = openend,
-		_closestart = openstart, _closeend = openend,
-		attributes = {},
-		id = nil,
-		classes = {},
-		deepernodes = Set:new(),
-		deeperelements = {}, deeperattributes = {}, deeperids = {}, deeperclasses = {}
+-- Document building {{{
+function ElementNode.newdocument(text)
+	local length = string.len(text)
+	local root = {
+		index = 0,
+		_text = text,
+		_textstarts = {}, _textends = {}, -- text between tags, recorded by the tokenizer
+		_names = {[0] = intern("root")}, _parents = {}, _firstchild = {}, _lastchild = {}, _nextsibling = {},
+		_openstarts = {[0] = 1}, _openends = {[0] = length},
+		_closestarts = {[0] = 1}, _closeends = {[0] = length},
+		_textfirsts = {[0] = 1},
+		_attrfirst = {[0] = 1}, _attrlast = {[0] = 0}, _attrkeys = {}, _attrstarts = {}, _attrends = {}, _attrvalues = {},
+		_ids = {}, _classes = {},
+		_views = setmetatable({}, {__mode = "v"})
 	}
-	if not node then
-		instance.name = "root"
-		instance.root = instance
-		instance._text = nameortext
-		local length = string.len(nameortext)
-		instance._openstart, instance._openend = 1, length
-		instance._closestart, instance._closeend = 1, length
-	elseif descend then
-		instance.root = node.root
-		instance.parent = node
-		instance.level = node.level + 1
-		table.insert(node.nodes, instance)
+	root.root = root
+	return setmetatable(root, ElementNode.mt)
+end
+
+-- Add an element (with an interned name) as the last child of element `parent`; returns its number
+function ElementNode:appendelement(name, parent, openstart, openend)
+	local i = #self._names + 1
+	self._names[i] = name
+	self._parents[i] = parent
+	self._openstarts[i], self._openends[i] = openstart, openend
+	self._closestarts[i], self._closeends[i] = openstart, openend
+	self._textfirsts[i] = #self._textstarts + 1 -- text spans recorded from here on fall inside this element until it closes
+	self._attrfirst[i], self._attrlast[i] = #self._attrkeys + 1, #self._attrkeys
+	local last = self._lastchild[parent]
+	if last then
+		self._nextsibling[last] = i
 	else
-		instance.root = node.root
-		instance.parent = node.parent or node --XXX: adds some safety but needs more testing for heisenbugs in corner cases
-		instance.level = node.level
-		table.insert((node.parent and node.parent.nodes or node.nodes), instance) --XXX: see above about heisenbugs
+		self._firstchild[parent] = i
 	end
-	return setmetatable(instance, ElementNode.mt)
+	self._lastchild[parent] = i
+	return i
 end
 
+-- Add an attribute (with an interned name) to element i, which must be the last one appended.
+-- Its value is the text from vstart to vend, unless given as v.
+function ElementNode:appendattribute(i, k, vstart, vend, v)
+	local a = #self._attrkeys + 1
+	self._attrkeys[a], self._attrstarts[a], self._attrends[a], self._attrvalues[a] = k, vstart, vend, v
+	self._attrlast[i] = a
+	local lower = lowercase[k]
+	if (lower == idkey or lower == classkey) and not v then
+		v = attributevalue(self, a)
+	end
+	if lower == idkey then
+		self._ids[i] = v
+	elseif lower == classkey then
+		self._classes[i] = self._classes[i] and self._classes[i] .. " " .. v or v
+	end
+end
+
+function ElementNode:closeelement(i, closestart, closeend)
+	self._closestarts[i], self._closeends[i] = closestart, closeend
+end
+-- }}}
+
 function ElementNode:gettext()
 	return string.sub(self.root._text, self._openstart, self._closeend)
 end
@@ -133,115 +190,118 @@ function ElementNode:settext(c)
 end
 
 function ElementNode:textonly()
-	return (self:gettext():gsub("<[^>]*>",""))
+	local text, starts, ends, first, last = self:textspans()
+	local pieces = {}
+	for k = first, last do pieces[#pieces + 1] = string.sub(text, starts[k], ends[k]) end
+	return table.concat(pieces)
 end
 
 function ElementNode:getcontent()
 	return string.sub(self.root._text, self._openend + 1, self._closestart - 1)
 end
 
-function ElementNode:addattribute(k, v)
-	self.attributes[k] = v
-	if string.lower(k) == "id" then
-		self.id = v
-	-- class attribute contains "space-separated tokens", each of which we'd like quick access to
-	elseif string.lower(k) == "class" then
-		for class in string.gmatch(v, "%S+") do
-			table.insert(self.classes, class)
-		end
-	end
+function ElementNode:getattribute(k)
+	local id = symbolids[k]
+	return id and attribute(self.root, self.index, id)
 end
 
-local function insert(table, name, node)
-	table[name] = table[name] or Set:new()
-	table[name]:add(node)
+function ElementNode:haschildren()
+	return self.root._firstchild[self.index] ~= nil
 end
 
-function ElementNode:close(closestart, closeend)
-	if closestart and closeend then
-		self._closestart, self._closeend = closestart, closeend
-	end
-	-- inform hihger level nodes about this element's existence in their branches
-	local node = self
-	while true do
-		node = node.parent
-		if not node then break end
-		node.deepernodes:add(self)
-		insert(node.deeperelements, self.name, self)
-		for k in pairs(self.attributes) do
-			insert(node.deeperattributes, k, self)
-		end
-		if self.id then
-			insert(node.deeperids, self.id, self)
-		end
-		for _,v in ipairs(self.classes) do
-			insert(node.deeperclasses, v, self)
+-- Text runs between tags inside this element, as positions into the document:
+-- returns the document text, the span start and end arrays, and the first and last span index
+function ElementNode:textspans()
+	local root, i = self.root, self.index
+	local starts = root._textstarts
+	local first, last = root._textfirsts[i], #starts
+	if i ~= 0 then
+		local closestart = root._closestarts[i]
+		last = first - 1
+		while starts[last + 1] and starts[last + 1] < closestart do
+			last = last + 1
 		end
 	end
+	return root._text, starts, root._textends, first, last
 end
 
-local function escape(s)
-	-- escape all ^, $, (, ), %, ., [, ], *, +, - , and ? with a % prefix
-	return string.gsub(s, "([%^%$%(%)%%%.%[%]%*%+%-%?])", "%%" .. "%1")
+-- Selectors {{{
+-- A selector compiles to one step per space-separated part, each holding the tests an element must pass
+-- (and the :not() tests it must fail). Elements are matched from the last step up through their ancestors
+-- during a document-order walk, so results come out already sorted and several selectors can share a walk.
+-- Matching works on element numbers; views are only made for the results.
+local function isspace(b) return b == nil or b == 32 or (b >= 9 and b <= 13) end
+local function hasclass(root, i, class)
+	local classes = root._classes[i]
+	if not classes then return false end
+	local s, e = string.find(classes, class, 1, true)
+	while s do
+		if isspace(string.byte(classes, s - 1)) and isspace(string.byte(classes, e + 1)) then return true end
+		s, e = string.find(classes, class, s + 1, true)
+	end
+	return false
 end
 
-local function select(self, s)
-	if not s or type(s) ~= "string" or s == "" then return Set:new() end
-	local sets = {[""]	= self.deeperelements, ["["] = self.deeperattributes,
-								["#"] = self.deeperids,			["."] = self.deeperclasses}
-	local function match(t, w)
-		local m, e, v
-		if t == "[" then w, m, e, v = string.match(w, 
-				"([^=|%*~%$!%^]+)" .. -- w = 1 or more characters up to a possible "=", "|", "*", "~", "$", "!", or "^"
-				"([|%*~%$!%^]?)" ..   -- m = an optional "|", "*", "~", "$", "!", or "^", preceding the optional "="
-				"(=?)" ..             -- e = the optional "="
-				"(.*)"                -- v = anything following the "=", or else ""
-			)
+local function compilesimple(stype, name)
+	if stype == "" then
+		local id = intern(name)
+		return function(root, i) return root._names[i] == id end
+	end
+	if stype == "#" then return function(root, i) return root._ids[i] == name end end
+	if stype == "." then return function(root, i) return hasclass(root, i, name) end end
+	local w, m, e, v = string.match(name, "([^=|%*~%$!%^]+)([|%*~%$!%^]?)(=?)(.*)") -- w = name, m = operator, e = "=", v = value
+	w = intern(w)
+	if e ~= "=" then return function(root, i) return attribute(root, i, w) ~= nil end end
+	if #v < 2 then v = "'" .. v .. "'" end -- values should be quoted
+	v = string.sub(v, 2, #v - 1) -- strip quotes
+	-- equals
+	if m == "" then return function(root, i) return attribute(root, i, w) == v end end
+	-- not equals (also matches elements without that attribute)
+	if m == "!" then return function(root, i) return attribute(root, i, w) ~= v end end
+	-- prefix
+	if m == "|" then return function(root, i)
+		local a = attribute(root, i, w)
+		return a ~= nil and string.match(a, "^[^-]*") == v
+	end end
+	-- contains
+	if m == "*" then return function(root, i)
+		local a = attribute(root, i, w)
+		return a ~= nil and string.find(a, v, 1, true) ~= nil
+	end end
+	-- word
+	if m == "~" then return function(root, i)
+		local a = attribute(root, i, w)
+		if a then
+			for word in string.gmatch(a, "%S+") do
+				if word == v then return true end
+			end
 		end
-		local matched = Set:new(sets[t][w])
-		-- attribute value selectors
-		if e == "=" then
-			if #v < 2 then v = "'" .. v .. "'" end -- values should be quoted
-			v = string.sub(v, 2, #v - 1) -- strip quotes
-			if m == "!" then matched = Set:new(self.deepernodes) end -- include those without that attribute
-			for node in pairs(matched) do
-				local a = node.attributes[w]
-				-- equals
-				if m == "" and a ~= v then matched:remove(node)
-				-- not equals
-				elseif m == "!" and a == v then matched:remove(node)
-				-- prefix
-				elseif m =="|" and string.match(a, "^[^-]*") ~= v then matched:remove(node)
-				-- contains
-				elseif m =="*" and string.match(a, escape(v)) ~= v then matched:remove(node)
-				-- word
-				elseif m =="~" then matched:remove(node)
-					for word in string.gmatch(a, "%S+") do
-						if word == v then matched:add(node) break end
-					end
-				-- starts with
-				elseif m =="^" and string.match(a, "^" .. escape(v)) ~= v then matched:remove(node)
-				-- ends with
-				elseif m =="$" and string.match(a, escape(v) .. "$") ~= v then matched:remove(node)
-				end
-			end -- for node
-		end -- if v
-		return matched
+		return false
+	end end
+	-- starts with
+	if m == "^" then return function(root, i)
+		local a = attribute(root, i, w)
+		return a ~= nil and string.sub(a, 1, #v) == v
+	end end
+	-- ends with
+	return function(root, i)
+		local a = attribute(root, i, w)
+		return a ~= nil and (#v == 0 or string.sub(a, -#v) == v)
 	end
+end
 
-	local subjects, resultset, childrenonly = Set:new({self})
+local compiled = {}
+local function compile(s)
+	if compiled[s] then return compiled[s] end
+	local steps, childrenonly = {attributes = {}}, false -- attributes: lowercase names of the attributes read
 	for part in string.gmatch(s, "%S+") do
 	repeat
 		if part == ">" then childrenonly = true --[[goto nextpart]] break end
-		resultset = Set:new()
-		for subject in pairs(subjects) do
-			local star = subject.deepernodes
-			if childrenonly then star = Set:new(subject.nodes) end
-			resultset = resultset + star
-		end
+		local step = {childrenonly = childrenonly, tests = {}, excludes = {}}
+		table.insert(steps, step)
 		childrenonly = false
 		if part == "*" then --[[goto nextpart]] break end
-		local excludes, filter = Set:new()
+		local filter
 		local start, pos = 0, 0
 		while true do
 			local switch, stype, name, eq, quote
@@ -267,28 +327,122 @@ local function select(self, s)
 				start, pos, value = string.find(part, "(%b" .. quote .. quote .. ")]", pos)
 				name = name .. eq .. value
 			end
-			local matched = match(stype, name)
-			if filter == "not" then
-				excludes = excludes + matched
-			else
-				resultset = resultset * matched
-			end
+			if stype == "#" then steps.attributes.id = true
+			elseif stype == "." then steps.attributes.class = true
+			elseif stype == "[" then steps.attributes[string.lower(string.match(name, "^[^=|%*~%$!%^]+"))] = true end
+			table.insert(filter == "not" and step.excludes or step.tests, compilesimple(stype, name))
 			--::nextname::
 	break
 	until true
 		end
-		resultset = resultset - excludes
-		subjects = Set:new(resultset)
 		--::nextpart::
-break
-until true
+	break
+	until true
+	end
+	compiled[s] = steps
+	return steps
+end
+
+
+local function matchstep(step, root, i)
+	for _, test in ipairs(step.tests) do
+		if not test(root, i) then return false end
+	end
+	for _, test in ipairs(step.excludes) do
+		if test(root, i) then return false end
+	end
+	return true
+end
+
+-- does element i match steps[1..k], with every matched ancestor strictly inside element `scope`?
+local function matches(root, steps, k, i, scope)
+	if not matchstep(steps[k], root, i) then return false end
+	local parents = root._parents
+	if k == 1 then
+		return not steps[1].childrenonly or parents[i] == scope
+	end
+	local ancestor = parents[i]
+	if steps[k].childrenonly then
+		return ancestor ~= nil and ancestor ~= scope and matches(root, steps, k - 1, ancestor, scope)
+	end
+	while ancestor and ancestor ~= scope do
+		if matches(root, steps, k - 1, ancestor, scope) then return true end
+		ancestor = parents[ancestor]
+	end
+	return false
+end
+
+-- call visit(i) for every element below `scope` in document order, until it returns true
+local function walk(root, scope, visit)
+	local firstchild, nextsibling, parents = root._firstchild, root._nextsibling, root._parents
+	local i = firstchild[scope]
+	while i do
+		if visit(i) then return end
+		if firstchild[i] then
+			i = firstchild[i]
+		else
+			while not nextsibling[i] do
+				i = parents[i]
+				if i == scope then return end
+			end
+			i = nextsibling[i]
+		end
 	end
-	resultset = resultset:tolist()
-	table.sort(resultset, function (a, b) return a.index < b.index end)
-	return resultset
 end
+-- }}}
 
-function ElementNode:select(s) return select(self, s) end
+-- Add the (lowercase) names of the attributes selector s reads to the set `into`, which is returned
+function ElementNode.selectorattributes(s, into)
+	into = into or {}
+	for name in pairs(compile(s).attributes) do
+		into[name] = true
+	end
+	return into
+end
+
+-- Evaluate several selectors in one walk over the tree: returns a list of results (in document order) per selector
+function ElementNode:selectMany(selectors)
+	local root, scope = self.root, self.index
+	local steps, results = {}, {}
+	for i, s in ipairs(selectors) do
+		steps[i] = compile(s)
+		results[i] = {}
+	end
+	walk(root, scope, function(i)
+		for n = 1, #steps do
+			local k = #steps[n]
+			if k > 0 and matches(root, steps[n], k, i, scope) then
+				local list = results[n]
+				list[#list + 1] = view(root, i)
+			end
+		end
+	end)
+	return results
+end
+
+-- The matches in document order; with a limit, the walk stops at the limit-th one
+local function select(self, s, limit)
+	if type(s) ~= "string" then return {} end
+	limit = limit or math.huge
+	local root, scope = self.root, self.index
+	local steps, results = compile(s), {}
+	local k = #steps
+	if k == 0 or limit < 1 then return results end
+	walk(root, scope, function(i)
+		if matches(root, steps, k, i, scope) then
+			results[#results + 1] = view(root, i)
+			return #results >= limit
+		end
+	end)
+	return results
+end
+
+function ElementNode:select(s, limit) return select(self, s, limit) end
 ElementNode.mt.__call = select
 
+-- The first node matching s in document order, or nil
+function ElementNode:selectFirst(s)
+	return select(self, s, 1)[1]
+end
+
 return ElementNode
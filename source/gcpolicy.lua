@@ -0,0 +1,86 @@
+-- Garbage collector policy
+-- Parsing makes a lot of short-lived garbage, so the collector runs
+-- incrementally and aggressively while a page loads. Reading makes little,
+-- so the collector switches to generational mode with cheap minor
+-- collections, and its remaining work is done in frames where the page is
+-- not moving. An optional overlay shows the GC time per frame.
+
+local GCPolicy = {}
+
+GCPolicy.modeParse = "parse"
+GCPolicy.modeRead = "read"
+
+local policies = {
+    -- Start a new cycle as soon as one ends, and collect 4x as fast as memory is allocated
+    parse = {collector = "incremental", pause = 100, stepMultiplier = 400, stepSize = 13},
+    -- Minor collections after 20% growth, a major one only once the heap doubles
+    read = {collector = "generational", minorMultiplier = 20, majorMultiplier = 100}
+}
+
+-- Collector work done in an idle reading frame
+local idleStepKB = 16
+
+local mode = nil
+local showStats = false
+local statsIntervalSeconds = 0.5
+local stepMs = 0 -- time spent in idle steps this frame
+local gcFraction = 0 -- share of frame time spent collecting, from the system stats
+
+function GCPolicy.set(newMode)
+    if newMode == mode then
+        return
+    end
+    local policy = policies[newMode]
+    assert(policy, "unknown GC mode " .. tostring(newMode))
+    if policy.collector == "incremental" then
+        collectgarbage("incremental", policy.pause, policy.stepMultiplier, policy.stepSize)
+    else
+        collectgarbage("generational", policy.minorMultiplier, policy.majorMultiplier)
+    end
+    mode = newMode
+end
+
+function GCPolicy.mode()
+    return mode
+end
+
+-- Called once per frame; `busy` is true while the page is scrolling
+function GCPolicy.update(busy)
+    stepMs = 0
+    if mode == GCPolicy.modeRead and not busy then
+        local start = playdate.getElapsedTime()
+        collectgarbage("step", idleStepKB)
+        stepMs = (playdate.getElapsedTime() - start) * 1000
+    end
+
+    if showStats then
+        local stats = playdate.getStats and playdate.getStats()
+        if stats and stats.GC then
+            gcFraction = stats.GC
+        end
+    end
+end
+
+function GCPolicy.setShowStats(show)
+    showStats = show
+    if playdate.setStatsInterval then
+        playdate.setStatsInterval(show and statsIntervalSeconds or 0)
+    end
+end
+
+-- Draw the GC time per frame in the top right corner
+function GCPolicy.drawStats()
+    if not showStats then
+        return
+    end
+    local frameMs = 1000 / playdate.display.getRefreshRate()
+    local text = string.format("GC %.1fms", gcFraction * frameMs + stepMs)
+    local gfx = playdate.graphics
+    local width, height = gfx.getTextSize(text)
+    local x = playdate.display.getWidth() - width - 4
+    gfx.setColor(gfx.kColorWhite)
+    gfx.fillRect(x - 2, 0, width + 6, height + 2)
+    gfx.drawText(text, x, 1)
+end
+
+return GCPolicy
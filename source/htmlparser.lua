@@ -29,22 +29,157 @@ local dbg = opts.debug and function(f,...) prn("d",f:gsub("#LINE#",str(line(3)))
 local ElementNode = import"ElementNode"
 local voidelements = import"voidelements"
 --}}}
+local intern, symbols, symbolids, lowercase = ElementNode.intern, ElementNode.symbols, ElementNode.symbolids, ElementNode.lowercase
+local idkey, classkey = intern("id"), intern("class")
+local voidnames = {} -- interned name -> whether it is a void element
+local function isvoid(name)
+	local void = voidnames[name]
+	if void == nil then
+		void = voidelements[symbols[lowercase[name]]] or false
+		voidnames[name] = void
+	end
+	return void
+end
+-- Elements whose content is raw text (code or data, not markup): their content is skipped with one search
+-- for the close tag, so nothing inside them becomes an element or a text span
+local rawtextelements = {"script", "style"}
+local function caseless(name) return (name:gsub("%a", function(c) return "[" .. c .. c:upper() .. "]" end)) end
+local rawtextstart = {} -- for the escaping pre-pass: pattern finding each element's start tag -> its close tag
+for _, raw in ipairs(rawtextelements) do
+	rawtextstart["<" .. caseless(raw) .. "[%s/>]"] = "</" .. caseless(raw) .. "[^>]*>"
+end
+local rawtextclose = {} -- interned name -> pattern finding the element's close tag after its "<", or false
+local function rawclose(name)
+	local pattern = rawtextclose[name]
+	if pattern == nil then
+		pattern = false
+		local lower = symbols[lowercase[name]]
+		for _, raw in ipairs(rawtextelements) do
+			if lower == raw then
+				pattern = "/" .. caseless(raw) .. "[^>]*>"
+			end
+		end
+		rawtextclose[name] = pattern
+	end
+	return pattern
+end
 local HtmlParser = {}
-local function parse(text,limit) -- {{{
+-- Implied end tags {{{
+-- As in HTML5, some start tags end an open element first: a new <p>, <li>, <td>, <tr>... ends the previous one,
+-- and block elements end an open paragraph. Each rule lists the elements ended and where the search stops.
+local function set(list)
+	local s = {}
+	for _, v in ipairs(list) do s[v] = true end
+	return s
+end
+local scope = {"html", "table", "td", "th", "caption", "button", "object", "marquee", "applet", "template"}
+local function implied(closes, stopat)
+	return {closes = set(closes), stopat = set(stopat or scope)}
+end
+local endsparagraph = implied({"p"})
+local impliedends = { -- lowercase start tag name -> rules
+	li = {implied({"li"}, {"ul", "ol", table.unpack(scope)}), endsparagraph},
+	dt = {implied({"dt", "dd"}, {"dl", table.unpack(scope)}), endsparagraph},
+	dd = {implied({"dt", "dd"}, {"dl", table.unpack(scope)}), endsparagraph},
+	td = {implied({"td", "th"}, {"tr", "table", "html", "template"})},
+	th = {implied({"td", "th"}, {"tr", "table", "html", "template"})},
+	tr = {implied({"tr"}, {"thead", "tbody", "tfoot", "table", "html", "template"})},
+	thead = {implied({"thead", "tbody", "tfoot"}, {"table", "html", "template"})},
+	tbody = {implied({"thead", "tbody", "tfoot"}, {"table", "html", "template"})},
+	tfoot = {implied({"thead", "tbody", "tfoot"}, {"table", "html", "template"})},
+	option = {{closes = set({"option"}), stopat = {}, toponly = true}}
+}
+for _, name in ipairs({"address", "article", "aside", "blockquote", "center", "details", "dialog", "dir", "div",
+		"dl", "fieldset", "figcaption", "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6", "header",
+		"hgroup", "hr", "main", "menu", "nav", "ol", "p", "pre", "section", "summary", "table", "ul"}) do
+	impliedends[name] = {endsparagraph}
+end
+-- }}}
+-- Subtree pruning {{{
+-- Elements matching an ignore list of simple selectors ("tag", "#id" or ".class") are kept, but empty:
+-- everything up to their matching close tag is skipped without being parsed
+local function pruner(ignore)
+	if not ignore or #ignore == 0 then return nil end
+	local tags, ids, classes, anyclass = {}, {}, {}, false
+	for _, selector in ipairs(ignore) do
+		local stype, name = selector:match("^([#.]?)([%w-_]+)$")
+		if stype == "" then tags[name:lower()] = true
+		elseif stype == "#" then ids[name] = true
+		elseif stype == "." then classes[name] = true anyclass = true
+		else err("Unsupported ignore selector: %s", selector) end
+	end
+	return function(root, tag, name)
+		if tags[symbols[lowercase[name]]] or ids[root._ids[tag] or ""] then return true end
+		if anyclass and root._classes[tag] then
+			for class in root._classes[tag]:gmatch("%S+") do
+				if classes[class] then return true end
+			end
+		end
+		return false
+	end
+end
+
+-- Lowercase form of a name, without interning it: the symbol table lives as long as the app, so only
+-- names stored in a document are interned
+local function lowername(name)
+	local id = symbolids[name]
+	return id and symbols[lowercase[id]] or name:lower()
+end
+
+-- Start and end of the close tag matching the element named `name` opened before `from`, counting nested
+-- elements of the same name; nil if it is never closed
+local function subtreeend(text, name, from)
+	local lower, depth, pos = symbols[lowercase[name]], 1, from
+	while true do
+		local s, e, closing, tagname = text:find("<(/?)([%w-]+)[^>]*>", pos)
+		if not s then return nil end
+		if lowername(tagname) == lower then
+			depth = depth + (closing == "" and 1 or -1)
+			if depth == 0 then return s, e end
+		end
+		pos = e + 1
+	end
+end -- }}}
+
+-- Budgets {{{
+-- A parse can be given a time budget (milliseconds of parsing, not counting time handed back to a resumable
+-- parser's caller) and a memory limit (KB the Lua heap may reach). Past `skimat` of either, the parser
+-- skims: it also skips the subtrees of the `skim` elements, which rarely hold content. Once a budget is
+-- spent it stops, closing whatever is still open; root.coverage tells how much of the text was parsed.
+local clock = playdate and playdate.getCurrentTimeMilliseconds or function() return os.clock() * 1000 end
+local budgetcheckevery = 32 -- elements between checks
+local defaultskim = {"nav", "header", "footer", "aside", "form", "svg", "noscript", "iframe", "select", "button"}
+local skimat = 0.75
+-- }}}
+-- Before tokenizing, comments are stripped and "<"/">" inside attribute values and template placeholders are
+-- escaped. A resumable parser does this a slice of about this many bytes at a time, cut between two tags.
+local prepassslice = 8192
+-- options (all optional):
+--   attributes: set of (lowercase) attribute names to store; others are skipped
+--   ignore: list of "tag", "#id" or ".class" selectors for elements whose content is skipped
+--   timebudget, memorylimit: see Budgets above
+--   skim: ignore selectors added when skimming (defaults to common page chrome)
+local function parse(text,yieldevery,options) -- {{{
+	options = options or {}
+	local attributes = options.attributes
+	local prune = pruner(options.ignore)
+	local timebudget, memorylimit = options.timebudget, options.memorylimit
+	local started, spent = clock(), 0
+	local skimming = false
 	local opts = rine(opts) -- use top-level opts-table (the one, defined before requiring the module), if exists
 		or rit(htmlparser_opts) -- or defined after requiring (but before calling `parse`)
 		or {} -- fallback otherwise
-	opts.looplimit = opts.looplimit or htmlparser_looplimit
 
 	local text = str(text)
-	local limit = limit or opts.looplimit or 1000
 	local tpl = false
-
-	if not opts.keep_comments then -- Strip (or not) comments {{{
-		text = text:gsub("<!%-%-.-%-%->","") -- Many chances commented code will have syntax errors, that'll lead to parser failures
+	local function handback(progress) -- {{{ hand control back to a resumable parser's caller
+		spent = spent + clock() - started
+		coroutine.yield(progress)
+		started = clock()
 	end -- }}}
 
 	local tpr={}
+	local escape -- escapes a slice of the text, unless keep_danger_placeholders
 
 	if not opts.keep_danger_placeholders then -- {{{ little speedup by cost of potential parsing breakages
 		-- search unused "invalid" bytes {{{
@@ -110,7 +245,7 @@ local function parse(text,limit) -- {{{
 		-- g }}}
 
 		-- tpl-placeholders and attributes {{{
-		text=text
+		escape = function(slice) return (slice
 			:gsub(
 				"(=[%s]-)".. -- only match attr.values, and not random strings between two random apostrophs
 				"(%b'')",
@@ -137,113 +272,224 @@ local function parse(text,limit) -- {{{
 				"(%2)(>)".. -- placeholder's tail
 				"([^>]*>)", -- remainings
 				function(...)return g(5,...)end
-			)
+			))
+		end
 		-- }}}
 	end -- }}}
 
-	local index = 0
-	local root = ElementNode:new(index, str(text))
-	local node, descend, tpos, opentags = root, true, 1, {}
+	if escape or not opts.keep_comments then -- Strip (or not) comments, and escape, a slice at a time {{{
+		-- Many chances commented code will have syntax errors, that'll lead to parser failures.
+		-- Script and style content is copied as it is: the tokenizer skips it with one search, and escaping
+		-- it would cost more than all the markup on script-heavy pages.
+		local pieces, pos, sinceyield = {}, 1, 0
+		local commentat, commentend
+		local function nextcomment(from)
+			commentat = not opts.keep_comments and text:find("<!--", from, true)
+			commentend = commentat and select(2, text:find("-->", commentat + 4, true))
+			if not commentend then commentat = nil end -- an unterminated comment is kept
+		end
+		local function rawstart(slice) -- offset in the slice of the first script or style, and its close pattern
+			local first, closes
+			for startpattern, closepattern in pairs(rawtextstart) do
+				local at = slice:find(startpattern)
+				if at and (not first or at < first) then first, closes = at, closepattern end
+			end
+			return first, closes
+		end
+		nextcomment(1)
+		while pos <= #text do
+			local stop, resume -- the slice ends at stop; the next one starts at resume
+			local cut = text:find(">%s*<", pos + prepassslice)
+			if commentat and (not cut or commentat <= cut) then
+				stop, resume = commentat - 1, commentend + 1
+			else
+				stop = cut or #text
+				resume = stop + 1
+			end
+			local slice = text:sub(pos, stop)
+			local raw -- content of a script or style starting in the slice, which then ends with its start tag
+			local rawat, closepattern
+			if escape then rawat, closepattern = rawstart(slice) end
+			local starttagend = rawat and text:find(">", pos + rawat - 1, true)
+			if starttagend then
+				local closeat = text:find(closepattern, starttagend + 1) or #text + 1
+				slice, raw, resume = text:sub(pos, starttagend), text:sub(starttagend + 1, closeat - 1), closeat
+			end
+			pieces[#pieces + 1] = escape and escape(slice) or slice
+			pieces[#pieces + 1] = raw
+			if commentat and commentat < resume then nextcomment(resume) end
+			sinceyield = sinceyield + resume - pos
+			pos = resume
+			if yieldevery and sinceyield >= prepassslice then
+				sinceyield = 0
+				handback(0)
+			end
+		end
+		text = table.concat(pieces)
+	end -- }}}
 
+	local count = 0
+	-- The escaping above turns a "<" into tpr["<"] when a later ">" follows in the same tag-like run. Raw-text
+	-- content is not escaped, but a close tag the pre-pass did not pair with its start tag may still be.
+	local rawopen = tpl and "[<%" .. tpr["<"] .. "]" or "<"
+	local root = ElementNode.newdocument(str(text))
+	local text = root._text
+	local stack, stacknames, top = {}, {}, 0 -- open elements, with their lowercase names
+	local textstarts, textends, textpos = root._textstarts, root._textends, 1
+	local function addtext(textend) -- {{{ record the text between the previous tag and the one starting after textend
+		if textend >= textpos then
+			textstarts[#textstarts + 1] = textpos
+			textends[#textends + 1] = textend
+		end
+	end -- }}}
+	local function closeto(depth, closestart, closeend) -- {{{ close the open elements down to stack[depth]
+		for d = top, depth + 1, -1 do -- implicitly closed, just before the tag at closestart
+			root:closeelement(stack[d], closestart, closestart - 1)
+			stack[d], stacknames[d] = nil, nil
+		end
+		root:closeelement(stack[depth], closestart, closeend)
+		stack[depth], stacknames[depth] = nil, nil
+		top = depth - 1
+	end -- }}}
+	local function endimplied(rule, tpos) -- {{{ end the open element a start tag at tpos implies the end of
+		for d = top, 1, -1 do
+			local name = stacknames[d]
+			if rule.closes[name] then return closeto(d, tpos, tpos - 1) end
+			if rule.toponly or rule.stopat[name] then return end
+		end
+	end -- }}}
+
+	local tpos = 1
+	local coverage = 1
 	while true do -- MainLoop {{{
-		if index == limit then -- {{{
-			err("Main loop reached loop limit (%d). Consider either increasing it or checking HTML-code for syntax errors", limit)
-			break
-		end -- }}}
-		-- openstart/tpos Definitions {{{
-		local openstart, name
-		openstart, tpos, name = root._text:find(
+		-- tagstart/tpos Definitions {{{
+		local tagstart, closing, name
+		tagstart, tpos, closing, name = text:find(
 			"<" ..        -- an uncaptured starting "<"
-			"([%w-]+)" .. -- name = the first word, directly following the "<"
+			"(/?)" ..     -- closing = "/" for a close tag, else ""
+			"([%w-]+)" .. -- name = the first word, directly following the "<" or "</"
 			"[^>]*>",     -- include, but not capture everything up to the next ">"
 		tpos)
-		dbg("[MainLoop]:#LINE# openstart=%s || tpos=%s || name=%s",str(openstart),str(tpos),str(name))
+		dbg("[MainLoop]:#LINE# tagstart=%s || tpos=%s || closing=%s || name=%s",str(tagstart),str(tpos),str(closing),str(name))
 		-- }}}
-		if not name then break end
-		-- Some more vars {{{
-		index = index + 1
-		local tag = ElementNode:new(index, str(name), (node or {}), descend, openstart, tpos)
-		node = tag
-		local tagloop
-		local tagst, apos = tag:gettext(), 1
+		if not name then
+			addtext(#text)
+			break
+		end
+		addtext(tagstart - 1)
+		textpos = tpos + 1
+		local lower = lowername(name)
+
+		if closing == "/" then -- {{{ close the nearest open element of that name; ignore the tag if there is none
+			for d = top, 1, -1 do
+				if stacknames[d] == lower then
+					closeto(d, tagstart, tpos)
+					break
+				end
+			end
 		-- }}}
-		while true do -- TagLoop {{{
-			dbg("[TagLoop]:#LINE# tag.name=%s, tagloop=%s",str(tag.name),str(tagloop))
-			if tagloop == limit then -- {{{
-				err("Tag parsing loop reached loop limit (%d). Consider either increasing it or checking HTML-code for syntax errors", limit)
-				break
-			end -- }}}
-			-- Attrs {{{
-			local start, k, eq, quote, v, zsp
-			start, apos, k, zsp, eq, zsp, quote = tagst:find(
-				"%s+" ..         -- some uncaptured space
-				"([^%s=/>]+)" .. -- k = an unspaced string up to an optional "=" or the "/" or ">"
-				"([%s]-)"..      -- zero or more spaces
-				"(=?)" ..        -- eq = the optional; "=", else ""
-				"([%s]-)"..      -- zero or more spaces
-				[=[(['"]?)]=],      -- quote = an optional "'" or '"' following the "=", or ""
-			apos)
-			dbg("[TagLoop]:#LINE# start=%s || apos=%s || k=%s || zsp='%s' || eq='%s', quote=[%s]",str(start),str(apos),str(k),str(zsp),str(eq),str(quote))
+		else -- open tag {{{
+			name = intern(name)
+			for _, rule in ipairs(impliedends[lower] or {}) do
+				endimplied(rule, tagstart)
+			end
+			count = count + 1
+			local tag = root:appendelement(name, stack[top] or 0, tagstart, tpos)
+			local apos = tagstart -- attributes are read from the document in place, up to the tag's end at tpos
+			while true do -- TagLoop {{{
+				-- Attrs {{{
+				local start, k, eq, quote, zsp
+				start, apos, k, zsp, eq, zsp, quote = text:find(
+					"%s+" ..         -- some uncaptured space
+					"([^%s=/>]+)" .. -- k = an unspaced string up to an optional "=" or the "/" or ">"
+					"([%s]-)"..      -- zero or more spaces
+					"(=?)" ..        -- eq = the optional; "=", else ""
+					"([%s]-)"..      -- zero or more spaces
+					[=[(['"]?)]=],      -- quote = an optional "'" or '"' following the "=", or ""
+				apos)
+				dbg("[TagLoop]:#LINE# start=%s || apos=%s || k=%s || zsp='%s' || eq='%s', quote=[%s]",str(start),str(apos),str(k),str(zsp),str(eq),str(quote))
+				-- }}}
+				if not k or start > tpos then break end
+				local keep = not attributes or attributes[lowername(k)] -- skipped attributes are scanned past, uninterned
+				-- Pattern {{{ the value's position, not a copy of it
+				local vstart, vend = apos + 1, apos
+				if eq == "=" then
+					local pattern = "=()[^%s>]*()"
+					if quote ~= "" then
+						pattern = quote .. "()[^" .. quote .. "]*()" .. quote
+					end
+					start, apos, vstart, vend = text:find(pattern, apos)
+					dbg("[TagLoop]:#LINE# start=%s || apos=%s || vstart=%s || vend=%s || pattern=%s",str(start),str(apos),str(vstart),str(vend),str(pattern))
+					if not start or apos > tpos then break end -- unterminated value
+					vend = vend - 1
+				end
+				-- }}}
+				if keep then
+					k = intern(k)
+					local v -- ids and classes are matched often, so they are kept as strings
+					local lower = lowercase[k]
+					if lower == idkey or lower == classkey then
+						v = text:sub(vstart, vend)
+						if tpl then -- {{{
+							for rk,rv in pairs(tpr) do
+								v = v:gsub(rv,rk)
+								dbg("[TagLoop]:#LINE# rv=%s || rk=%s",str(rv),str(rk))
+							end
+						end -- }}}
+					end
+
+					dbg("[TagLoop]:#LINE# k=%s || vstart=%s || vend=%s",str(symbols[k]),str(vstart),str(vend))
+					root:appendattribute(tag, k, vstart, vend, v)
+				end
+			end
 			-- }}}
-			if not k or k == "/>" or k == ">" then break end
-			-- Pattern {{{
-			if eq == "=" then
-				local pattern = "=([^%s>]*)"
-				if quote ~= "" then
-					pattern = quote .. "([^" .. quote .. "]*)" .. quote
+			local rawpattern = rawclose(name)
+			local selfclosing = text:byte(tpos - 1) == 47 -- "/>"
+			local prunestart, pruneend
+			if prune and not isvoid(name) and not rawpattern and not selfclosing and prune(root, tag, name) then
+				prunestart, pruneend = subtreeend(text, name, tpos + 1)
+			end
+			if isvoid(name) or selfclosing then -- {{{
+				-- already closed: its close positions stay those of the open tag
+			elseif rawpattern then -- closed at once, after its skipped content
+				local closestart, closeend = text:find(rawopen .. rawpattern, tpos + 1)
+				if not closestart then -- unterminated: the rest of the document is its content
+					closestart, closeend = #text + 1, #text
 				end
-				start, apos, v = tagst:find(pattern, apos)
-				dbg("[TagLoop]:#LINE# start=%s || apos=%s || v=%s || pattern=%s",str(start),str(apos),str(v),str(pattern))
+				root:closeelement(tag, closestart, closeend)
+				tpos, textpos = closeend, closeend + 1
+			elseif prunestart then -- closed at once, its subtree skipped
+				root:closeelement(tag, prunestart, pruneend)
+				tpos, textpos = pruneend, pruneend + 1
+			else
+				top = top + 1
+				stack[top], stacknames[top] = tag, lower
 			end
 			-- }}}
-			v=v or ""
-			if tpl then -- {{{
-				for rk,rv in pairs(tpr) do
-					v = v:gsub(rv,rk)
-					dbg("[TagLoop]:#LINE# rv=%s || rk=%s",str(rv),str(rk))
+			if (timebudget or memorylimit) and count % budgetcheckevery == 0 then -- {{{ check the budgets
+				local used = math.max(timebudget and (spent + clock() - started) / timebudget or 0,
+					memorylimit and collectgarbage("count") / memorylimit or 0)
+				if used >= 1 then
+					coverage = tpos / #text
+					dbg("[Budget]:#LINE# stopping at %s", str(coverage))
+					break
+				elseif used >= skimat and not skimming then
+					skimming = true
+					local ignore = {table.unpack(options.ignore or {})}
+					for _, selector in ipairs(options.skim or defaultskim) do ignore[#ignore + 1] = selector end
+					prune = pruner(ignore)
 				end
 			end -- }}}
-
-			dbg("[TagLoop]:#LINE# k=%s || v=%s",str(k),str(v))
-			tag:addattribute(k, v)
-			tagloop = (tagloop or 0) + 1
-		end
-		-- }}}
-		if voidelements[tag.name:lower()] then -- {{{
-			descend = false
-			tag:close()
-		else
-			descend = true
-			opentags[tag.name] = opentags[tag.name] or {}
-			table.insert(opentags[tag.name], tag)
-		end
-		-- }}}
-		local closeend = tpos
-		local closingloop
-		while true do -- TagCloseLoop {{{
-			-- Can't remember why did I add that, so comment it for now (and not remove), in case it will be needed again
-			-- (although, it causes #59 and #60, so it will anyway be needed to rework)
-			-- if voidelements[tag.name:lower()] then break end -- already closed
-			if closingloop == limit then
-				err("Tag closing loop reached loop limit (%d). Consider either increasing it or checking HTML-code for syntax errors", limit)
-				break
-			end
-
-			local closestart, closing, closename
-			closestart, closeend, closing, closename = root._text:find("[^<]*<(/?)([%w-]+)", closeend)
-			dbg("[TagCloseLoop]:#LINE# closestart=%s || closeend=%s || closing=%s || closename=%s",str(closestart),str(closeend),str(closing),str(closename))
-
-			if not closing or closing == "" then break end
-
-			tag = table.remove(opentags[closename] or {}) or tag -- kludges for the cases of closing void or non-opened tags
-			closestart = root._text:find("<", closestart)
-			dbg("[TagCloseLoop]:#LINE# closestart=%s",str(closestart))
-			tag:close(closestart, closeend + 1)
-			node = tag.parent
-			descend = true
-			closingloop = (closingloop or 0) + 1
+			if yieldevery and count % yieldevery == 0 then -- {{{ hand control back to a resumable parser's caller
+				handback(tpos / #text)
+			end -- }}}
 		end -- }}}
 	end -- }}}
+	if top > 0 then -- elements still open end with the document (or where parsing stopped)
+		local stop = coverage < 1 and tpos or #text
+		closeto(1, stop + 1, stop)
+	end
+	root.coverage, root.skimmed = coverage, skimming
 	if tpl then -- {{{
 		dbg("tpl")
 		for k,v in pairs(tpr) do
@@ -252,5 +498,24 @@ local function parse(text,limit) -- {{{
 	end -- }}}
 	return root
 end -- }}}
-HtmlParser.parse = parse
+-- Resumable parsing {{{
+-- Returns a step function that parses the next `yieldevery` tags (64 by default) on each call.
+-- While unfinished it returns nil and the fraction of the text consumed; once done it returns the root.
+-- The parse state (open elements, position) lives in a coroutine between calls.
+local function parser(text,yieldevery,options)
+	local co = coroutine.create(parse)
+	local root
+	return function()
+		if root then return root end
+		local ok, res = coroutine.resume(co, text, yieldevery or 64, options)
+		if not ok then error(res, 0) end
+		if coroutine.status(co) == "dead" then
+			root = res
+			return root
+		end
+		return nil, res
+	end
+end -- }}}
+HtmlParser.parse = function(text,options) return parse(text,nil,options) end
+HtmlParser.parser = parser
 return HtmlParser
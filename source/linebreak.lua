@@ -0,0 +1,193 @@
+-- Word-wrap and line-breaking engine
+-- Breaks a paragraph into lines once, using the font metrics directly, and
+-- returns them as a flat array of (start, end, width, style) per line.
+-- Byte ranges index into the paragraph string, so no line text is copied.
+--
+-- Text uses the same markup as gfx.drawText: "*" toggles bold, "_" toggles
+-- italic, and a doubled marker stands for the literal character.
+
+local LineBreak = {}
+
+LineBreak.stride = 4
+LineBreak.styleRegular = 0
+LineBreak.styleBold = 1
+LineBreak.styleItalic = 2
+
+local maxCachedWidths = 4000
+
+local wordWidths = {}
+local cachedWidthCount = 0
+
+local function fontForStyle(fonts, style)
+    if style & LineBreak.styleBold ~= 0 then
+        return fonts.bold
+    elseif style & LineBreak.styleItalic ~= 0 then
+        return fonts.italic
+    end
+    return fonts.regular
+end
+
+local function textWidth(font, text)
+    local widths = wordWidths[font]
+    if not widths then
+        widths = {}
+        wordWidths[font] = widths
+    end
+
+    local width = widths[text]
+    if not width then
+        if cachedWidthCount >= maxCachedWidths then
+            widths = {}
+            wordWidths = {[font] = widths}
+            cachedWidthCount = 0
+        end
+        width = font:getTextWidth(text)
+        widths[text] = width
+        cachedWidthCount += 1
+    end
+    return width
+end
+
+-- Call fn(run, style) for every same-style run in text[s..e], starting in
+-- `style`; returns the style in effect after the range
+local function eachRun(text, s, e, style, fn)
+    local pos = s
+    local pending = nil
+    while pos <= e do
+        local marker = string.find(text, "[%*_]", pos)
+        if not marker or marker > e then
+            break
+        end
+
+        local markerChar = string.sub(text, marker, marker)
+        if marker < e and string.sub(text, marker + 1, marker + 1) == markerChar then
+            -- Doubled marker: keep one literal character in the current run
+            pending = (pending or "") .. string.sub(text, pos, marker)
+            pos = marker + 2
+        else
+            local run = (pending or "") .. string.sub(text, pos, marker - 1)
+            if #run > 0 then
+                fn(run, style)
+            end
+            pending = nil
+            style = style ~ (markerChar == "*" and LineBreak.styleBold or LineBreak.styleItalic)
+            pos = marker + 1
+        end
+    end
+
+    local run = (pending or "") .. string.sub(text, pos, e)
+    if #run > 0 then
+        fn(run, style)
+    end
+    return style
+end
+
+local function measureRange(fonts, text, s, e, style)
+    local width, runs = 0, 0
+    local styleAfter = eachRun(text, s, e, style, function(run, runStyle)
+        local font = fontForStyle(fonts, runStyle)
+        if runs > 0 then
+            width += font:getTracking()
+        end
+        width += textWidth(font, run)
+        runs += 1
+    end)
+    return width, styleAfter
+end
+
+-- Longest prefix of text[s..e] that fits in maxWidth, cut on a UTF-8
+-- character boundary and never inside a doubled marker
+local function fittingPrefix(fonts, text, s, e, style, maxWidth)
+    local cut = nil
+    local pos = s
+    while pos <= e do
+        local _, charEnd = string.find(text, "^[%z\1-\127\194-\244][\128-\191]*", pos)
+        charEnd = math.min(charEnd or pos, e)
+        local char = string.sub(text, charEnd, charEnd)
+        local doubled = (char == "*" or char == "_") and charEnd < e
+            and string.sub(text, charEnd + 1, charEnd + 1) == char
+        if not doubled then
+            if cut and measureRange(fonts, text, s, charEnd, style) > maxWidth then
+                break
+            end
+            cut = charEnd
+        end
+        pos = charEnd + 1
+    end
+    return cut or e
+end
+
+-- Break `text` into lines no wider than maxWidth
+function LineBreak.breakText(fonts, text, maxWidth)
+    local lines = {}
+    local length = #text
+    local style = LineBreak.styleRegular
+    local lineStart, lineEnd, lineWidth, lineStyle = nil, nil, 0, style
+
+    local function emit()
+        if lineStart then
+            local n = #lines
+            lines[n + 1] = lineStart
+            lines[n + 2] = lineEnd
+            lines[n + 3] = lineWidth
+            lines[n + 4] = lineStyle
+        end
+        lineStart = nil
+    end
+
+    local pos = 1
+    while pos <= length do
+        local wordStart, wordEnd = string.find(text, "[^ ]+", pos)
+        if not wordStart then
+            break
+        end
+
+        local wordWidth, styleAfter = measureRange(fonts, text, wordStart, wordEnd, style)
+        local font = fontForStyle(fonts, style)
+        local gap = textWidth(font, " ") + font:getTracking() * 2
+
+        if lineStart and lineWidth + gap + wordWidth <= maxWidth then
+            lineEnd = wordEnd
+            lineWidth += gap + wordWidth
+            style = styleAfter
+        else
+            emit()
+            -- Words wider than a whole line are cut wherever they stop fitting
+            while wordWidth > maxWidth and wordStart < wordEnd do
+                local cut = fittingPrefix(fonts, text, wordStart, wordEnd, style, maxWidth)
+                if cut >= wordEnd then
+                    break
+                end
+                lineStart, lineEnd, lineStyle = wordStart, cut, style
+                lineWidth, style = measureRange(fonts, text, wordStart, cut, style)
+                emit()
+                wordStart = cut + 1
+                wordWidth, styleAfter = measureRange(fonts, text, wordStart, wordEnd, style)
+            end
+            lineStart, lineEnd, lineWidth, lineStyle = wordStart, wordEnd, wordWidth, style
+            style = styleAfter
+        end
+
+        pos = wordEnd + 1
+    end
+    emit()
+
+    return lines
+end
+
+-- Forget memoized word widths
+function LineBreak.clearCache()
+    wordWidths = {}
+    cachedWidthCount = 0
+end
+
+-- Draw text[s..e] starting in `style` with its top-left corner at x, y
+function LineBreak.drawLine(fonts, text, s, e, style, x, y)
+    eachRun(text, s, e, style, function(run, runStyle)
+        local font = fontForStyle(fonts, runStyle)
+        font:drawText(run, x, y)
+        x += textWidth(font, run) + font:getTracking()
+    end)
+end
+
+return LineBreak
@@ -5,7 +5,13 @@ import "CoreLibs/graphics"
 import "CoreLibs/ui"
 
 local gfx <const> = playdate.graphics
-local siteParsers = import "siteparsers"
+local siteRegistry = import "siteparsers"
+local measureCache = import "measurecache"
+local lineBreak = import "linebreak"
+local memory = import "memory"
+local scheduler = import "scheduler"
+local gcPolicy = import "gcpolicy"
+local pageCache = import "pagecache"
 
 local screenWidth, screenHeight = 400, 240
 local cursorHalfHeight = 5
@@ -16,14 +22,18 @@ local currentURL = nil
 local currentContent = nil
 local statusMessage = "Connecting to WiFi..."
 local pendingURL = nil  -- URL to load in next update
+local pendingFromCache = false  -- load pendingURL from the page cache if it's there
 local viewportTop = 0
 local cursorY = cursorHalfHeight
 
 -- Button selection state (determined during render)
 local hoveredButton = nil
-local pageImage = nil
+local pageLines = nil  -- per-line arrays of the laid out page, nil while loading
+local pageTiles = {}
+local pageTileCount = 0
 local pageButtons = {}
 local pageHeight = 0
+local tilesStarved = false  -- a tile failed even after relieving memory: draw lines directly until relief
 
 -- Network state
 local networkReady = false
@@ -37,6 +47,16 @@ local fetchURL = nil
 local fetchParser = nil
 local historyStack = {}
 
+-- Print each fetched page to the console (for debugging site rules)
+local dumpFetchedHTML = false
+
+-- Frames over which a finished page's HTML and DOM are collected
+local releaseFrames = 30
+
+-- Parse and layout run as scheduled tasks within this much of each frame
+local taskBudgetMs = 20
+local loadTask = nil
+
 -- Rendering helpers
 local textFonts = {
     regular = gfx.font.new("fonts/Asheville-Sans-14-Bold"),
@@ -51,12 +71,53 @@ gfx.setFontFamily({
 })
 local defaultFontHeight = textFonts.regular and textFonts.regular:getHeight() or 16
 local textLineHeight = math.max(defaultFontHeight, 16)
+local textLineAdvance = defaultFontHeight + (textFonts.regular and textFonts.regular:getLeading() or 0)
+local fontFamilyKey = "asheville"
 local contentPadding = 10
 local contentWidth = screenWidth - contentPadding * 2
 local paragraphSpacing = 4
 local buttonSpacing = 8
+local tileHeight = screenHeight
+local maxCachedTiles = 6
 cursorY = contentPadding + cursorHalfHeight
 
+-- Index of the last page line whose top is at or above y
+local function lineIndexAt(y)
+    local tops = pageLines and pageLines.y
+    if not tops or #tops == 0 or tops[1] > y then
+        return nil
+    end
+
+    local low, high = 1, #tops
+    while low < high do
+        local mid = (low + high + 1) // 2
+        if tops[mid] <= y then
+            low = mid
+        else
+            high = mid - 1
+        end
+    end
+    return low
+end
+
+-- Move a viewport top onto a line boundary, rounding down (direction < 0)
+-- or up (direction > 0), as long as that moves it by less than a line
+local function snapToLine(top, direction)
+    local index = lineIndexAt(top)
+    if not index then
+        return top
+    end
+
+    local snapped = pageLines.y[index]
+    if direction > 0 and snapped < top then
+        snapped = pageLines.y[index + 1] or top
+    end
+    if math.abs(snapped - top) >= textLineAdvance then
+        return top
+    end
+    return snapped
+end
+
 local function updateViewportBounds(newTop)
     local desiredTop = newTop or viewportTop
     local maxTop = math.max(0, pageHeight - screenHeight)
@@ -77,9 +138,9 @@ local function ensureCursorVisible()
     local bottomBoundary = viewportTop + screenHeight - cursorHalfHeight
 
     if cursorY < topBoundary then
-        updateViewportBounds(cursorY - cursorHalfHeight)
+        updateViewportBounds(snapToLine(cursorY - cursorHalfHeight, -1))
     elseif cursorY > bottomBoundary then
-        updateViewportBounds(cursorY + cursorHalfHeight - screenHeight)
+        updateViewportBounds(snapToLine(cursorY + cursorHalfHeight - screenHeight, 1))
     end
 end
 
@@ -100,68 +161,212 @@ local function resetViewToTop()
     ensureCursorVisible()
 end
 
-local function preparePageImage(elements)
-    pageImage = nil
+local function clearPage()
+    pageLines = nil
+    pageTiles = {}
+    pageTileCount = 0
     pageButtons = {}
     pageHeight = 0
+    tilesStarved = false
+end
 
-    if not elements or #elements == 0 then
-        statusMessage = "Loading..."
-        return
+local function breakParagraph(text)
+    local lines = measureCache.get(fontFamilyKey, contentWidth, text)
+    if not lines then
+        lines = lineBreak.breakText(textFonts, text, contentWidth)
+        measureCache.put(fontFamilyKey, contentWidth, text, lines)
+    end
+    return lines
+end
+
+-- Element stream over a parsed element list, in the form pageCache.open
+-- gives for a cached page: a function returning the next element's kind and
+-- fields, and one returning the share of the list consumed
+local function listElements(elements)
+    local index = 0
+    local function nextElement()
+        index += 1
+        local element = elements[index]
+        if not element then
+            return nil
+        elseif element.kind == "spacer" then
+            return "spacer", element.size
+        elseif element.kind == "button" then
+            return "button", element.label or element.content or "Link", element.url
+        end
+        return "text", element.content or ""
     end
+    local function progress()
+        return index / #elements
+    end
+    return nextElement, progress
+end
+
+-- Lay out an element stream (see listElements); returns the element count
+local function preparePage(nextElement, progress)
+    clearPage()
 
     gfx.setFont(textFonts.regular)
 
-    local textCommands = {}
+    local lines = {text = {}, first = {}, last = {}, width = {}, style = {}, y = {}}
+    local stride = lineBreak.stride
     local currentY = 0
+    local count = 0
 
-    for _, element in ipairs(elements) do
-        if element.kind == "spacer" then
-            currentY += element.size or paragraphSpacing
-        elseif element.kind == "button" then
-            local label = element.label or element.content or "Link"
+    while true do
+        local kind, field, url = nextElement()
+        if not kind then
+            break
+        end
+        count += 1
+        scheduler.checkpoint(progress())
+        if kind == "spacer" then
+            currentY += field or paragraphSpacing
+        elseif kind == "button" then
+            local label = field
             local _, height = gfx.getTextSize(label)
             height = height or textLineHeight
             table.insert(pageButtons, {
                 label = label,
-                url = element.url,
+                url = url,
                 y = currentY,
                 height = height
             })
             currentY += height + buttonSpacing
         else
-            local text = element.content or ""
-            local _, height = gfx.getTextSizeForMaxWidth(text, contentWidth)
-            height = height or textLineHeight
-            table.insert(textCommands, {
-                text = text,
-                y = currentY,
-                height = height
-            })
-            currentY += height + paragraphSpacing
+            local text = field
+            local breaks = breakParagraph(text)
+            local lineCount = #breaks // stride
+            for i = 0, lineCount - 1 do
+                local n = #lines.y + 1
+                lines.text[n] = text
+                lines.first[n] = breaks[i * stride + 1]
+                lines.last[n] = breaks[i * stride + 2]
+                lines.width[n] = breaks[i * stride + 3]
+                lines.style[n] = breaks[i * stride + 4]
+                lines.y[n] = contentPadding + currentY + i * textLineAdvance
+            end
+            currentY += math.max(lineCount, 1) * textLineAdvance + paragraphSpacing
         end
     end
 
+    if count == 0 then
+        statusMessage = "Loading..."
+        return 0
+    end
+
     local totalHeight = math.max(currentY + 20, (240 - contentPadding * 2))
-    local imageHeight = totalHeight + contentPadding * 2
-    local imageWidth = contentWidth + contentPadding * 2
 
-    local image = gfx.image.new(imageWidth, imageHeight)
-    gfx.lockFocus(image)
-    gfx.clear(gfx.kColorWhite)
-    gfx.setFont(textFonts.regular)
+    pageLines = lines
+    pageHeight = totalHeight + contentPadding * 2
+    return count
+end
 
-    for _, command in ipairs(textCommands) do
-        gfx.drawText(command.text, contentPadding, contentPadding + command.y, contentWidth, command.height)
+-- Draw the lines overlapping tile `index` (0-based), shifted up by originY
+local function drawTileLines(index, originY)
+    local tileTop = index * tileHeight
+    local lineIndex = lineIndexAt(tileTop - textLineAdvance) or 1
+    local tops = pageLines.y
+    while tops[lineIndex] and tops[lineIndex] < tileTop + tileHeight do
+        local top = tops[lineIndex]
+        if top + textLineAdvance > tileTop then
+            lineBreak.drawLine(textFonts, pageLines.text[lineIndex], pageLines.first[lineIndex],
+                pageLines.last[lineIndex], pageLines.style[lineIndex], contentPadding, top - originY)
+        end
+        lineIndex += 1
+    end
+end
+
+local function renderTile(index)
+    local image = gfx.image.new(contentWidth + contentPadding * 2, tileHeight, gfx.kColorWhite)
+    if not image then
+        return nil
     end
 
+    -- Tiles are drawn while the page is scrolled; the draw offset would shift them too
+    local offsetX, offsetY = gfx.getDrawOffset()
+    gfx.setDrawOffset(0, 0)
+    gfx.lockFocus(image)
+    drawTileLines(index, index * tileHeight)
     gfx.unlockFocus()
+    gfx.setDrawOffset(offsetX, offsetY)
     gfx.setColor(gfx.kColorBlack)
 
-    pageImage = image
-    pageHeight = imageHeight
+    return image
 end
 
+-- Drop cached tiles outside [keepFirst, keepLast], farthest first, until at
+-- most `limit` remain
+local function evictTiles(keepFirst, keepLast, limit)
+    while pageTileCount > limit do
+        local farthest, farthestDistance = nil, -1
+        for index in pairs(pageTiles) do
+            if index < keepFirst or index > keepLast then
+                local distance = math.max(keepFirst - index, index - keepLast)
+                if distance > farthestDistance then
+                    farthest, farthestDistance = index, distance
+                end
+            end
+        end
+        if not farthest then
+            return
+        end
+        pageTiles[farthest] = nil
+        pageTileCount -= 1
+    end
+end
+
+local function visibleTiles()
+    local top = math.floor(viewportTop + 0.5)
+    return top // tileHeight, (top + screenHeight - 1) // tileHeight
+end
+
+local function drawPageTiles(top)
+    local firstTile = top // tileHeight
+    local lastTile = (top + screenHeight - 1) // tileHeight
+    for index = firstTile, lastTile do
+        if index * tileHeight < pageHeight then
+            local tile = pageTiles[index]
+            if not tile and not tilesStarved then
+                tile = renderTile(index)
+                if not tile then
+                    memory.relieve(memory.levelCritical)
+                    tile = renderTile(index)
+                    tilesStarved = not tile
+                end
+                if tile then
+                    pageTiles[index] = tile
+                    pageTileCount += 1
+                end
+            end
+            if tile then
+                tile:draw(0, index * tileHeight)
+            else
+                -- Out of bitmap memory: draw straight to the screen instead
+                drawTileLines(index, 0)
+            end
+        end
+    end
+    evictTiles(firstTile, lastTile, maxCachedTiles)
+end
+
+-- Give back memory we can regenerate: off-screen tiles are redrawn and
+-- line breaks re-measured on demand, and the laid out page keeps the
+-- paragraph strings so the parsed element list is no longer needed. Saved
+-- measurements only go when memory is critical, since they are what makes
+-- the next layout of a page cheap.
+memory.onPressure(function(level)
+    local firstTile, lastTile = visibleTiles()
+    evictTiles(firstTile, lastTile, 0)
+    if level >= memory.levelCritical then
+        measureCache.clear()
+        lineBreak.clearCache()
+        if pageLines then
+            currentContent = nil
+        end
+    end
+end)
+
 local linkPadding = 2
 
 local function drawButtonElement(label, x, y, isSelected)
@@ -224,25 +429,41 @@ local function resolveURL(base, href)
     return origin .. "/" .. href
 end
 
-function loadURL(url)
+local startCachedLayout -- defined with the other load steps, below
+
+local function cancelLoad()
+    if loadTask then
+        scheduler.cancel(loadTask)
+        loadTask = nil
+        memory.collectGradually(releaseFrames)
+    end
+end
+
+function loadURL(url, fromCache)
+    -- Going back, or offline: show the cached copy if there is one
+    if (fromCache or not networkReady) and pageCache.has(url) then
+        cancelLoad()
+        statusMessage = "Loading: " .. url
+        resetViewToTop()
+        if startCachedLayout(url, networkReady and "cached" or "offline") then
+            return
+        end
+    end
+
     -- Check if network is ready
     if not networkReady then
         statusMessage = "Waiting for network..."
         pendingURL = url  -- Re-queue it
+        pendingFromCache = fromCache
         return
     end
 
     statusMessage = "Loading: " .. url
     resetViewToTop()
+    cancelLoad()
 
     -- Find matching site parser
-    local matchedParser = nil
-    for _, parser in ipairs(siteParsers) do
-        if string.match(url, parser.pattern) then
-            matchedParser = parser
-            break
-        end
-    end
+    local matchedParser = siteRegistry.find(url)
 
     if not matchedParser then
         statusMessage = "Error: No rules for this URL"
@@ -412,19 +633,132 @@ local function drawCursor()
     )
 end
 
+local progressHeight = 6
+
+local function drawProgress()
+    local task = scheduler.activeTask()
+    if not task then
+        return
+    end
+
+    local y = contentPadding + textLineHeight + paragraphSpacing
+    gfx.setColor(gfx.kColorBlack)
+    gfx.drawRect(contentPadding, y, contentWidth, progressHeight)
+    local filled = math.floor(contentWidth * math.max(0, math.min(task.progress, 1)))
+    if filled > 0 then
+        gfx.fillRect(contentPadding, y, filled, progressHeight)
+    end
+end
+
+local function showLoadError(message)
+    gcPolicy.set(gcPolicy.modeRead)
+    statusMessage = "Error: " .. message
+    currentContent = nil
+    clearPage()
+    resetViewToTop()
+end
+
+-- Lay out parsed content as a scheduled task, then show it and keep a copy
+-- in the page cache
+local function startLayout(content, url)
+    statusMessage = "Laying out page..."
+    loadTask = scheduler.spawn("layout", function()
+        local count = preparePage(listElements(content))
+        if count > 0 then
+            local saved, saveErr = pageCache.save(url, content)
+            if not saved then
+                print("Could not cache page:", saveErr)
+            end
+        end
+        return count
+    end, function(ok, count)
+        loadTask = nil
+        gcPolicy.set(gcPolicy.modeRead)
+        if not ok then
+            showLoadError(count or "Layout failed")
+            return
+        end
+        currentContent = content
+        currentURL = url
+        statusMessage = "Loaded " .. count .. " elements"
+        if content.coverage and content.coverage < 1 then
+            statusMessage = statusMessage .. " (" .. math.floor(content.coverage * 100) .. "% of page)"
+        elseif content.skimmed then
+            statusMessage = statusMessage .. " (skimmed)"
+        end
+        resetViewToTop()
+    end)
+end
+
+-- Lay out the cached copy of url straight from the file, as a scheduled
+-- task; `note` is added to the status line. Returns false if it isn't cached.
+function startCachedLayout(url, note)
+    local nextElement, progress, info = pageCache.open(url)
+    if not nextElement then
+        return false
+    end
+
+    statusMessage = "Laying out page..."
+    loadTask = scheduler.spawn("layout", function()
+        return preparePage(nextElement, progress)
+    end, function(ok, count)
+        loadTask = nil
+        gcPolicy.set(gcPolicy.modeRead)
+        if not ok then
+            showLoadError(count or "Layout failed")
+            return
+        end
+        currentContent = nil
+        currentURL = url
+        statusMessage = "Loaded " .. count .. " elements (" .. note .. ")"
+        if info.coverage and info.coverage < 1 then
+            statusMessage = statusMessage .. " (" .. math.floor(info.coverage * 100) .. "% of page)"
+        elseif info.skimmed then
+            statusMessage = statusMessage .. " (skimmed)"
+        end
+        resetViewToTop()
+    end)
+    return true
+end
+
+-- Run the site parser as a scheduled task, then lay out its result. The
+-- HTML (and the DOM built from it) is dropped as soon as the elements are
+-- extracted, and collected over the next frames.
+local function startParse(parser, html, url)
+    statusMessage = "Parsing HTML..."
+    gcPolicy.set(gcPolicy.modeParse)
+    loadTask = scheduler.spawn("parse", function()
+        local content, parseErr = siteRegistry.parse(parser, html, url)
+        html = nil
+        return content, parseErr
+    end, function(ok, content, parseErr)
+        loadTask = nil
+        html = nil
+        memory.collectGradually(releaseFrames)
+        if not ok then
+            showLoadError(content or "Parse failed")
+        elseif not content then
+            showLoadError(parseErr or "Parse failed")
+        else
+            startLayout(content, url)
+        end
+    end)
+end
+
 function renderContent()
     gfx.setDrawOffset(0, 0)
     gfx.clear()
 
-    if not pageImage then
+    if not pageLines then
         gfx.drawText(statusMessage or "Loading...", contentPadding, contentPadding)
+        drawProgress()
         hoveredButton = nil
         return
     end
 
     local drawOffset = math.floor(viewportTop + 0.5)
     gfx.setDrawOffset(0, -drawOffset)
-    pageImage:draw(0, 0)
+    drawPageTiles(drawOffset)
     hoveredButton = nil
 
     for _, button in ipairs(pageButtons) do
@@ -442,11 +776,17 @@ function renderContent()
 end
 
 function playdate.update()
+    local _, relieved = memory.update()
+    if relieved then
+        tilesStarved = false
+    end
+
     -- Handle pending URL load
     if pendingURL then
-        local url = pendingURL
+        local url, fromCache = pendingURL, pendingFromCache
         pendingURL = nil
-        loadURL(url)
+        pendingFromCache = false
+        loadURL(url, fromCache)
     end
 
     -- Handle fetch completion
@@ -459,22 +799,12 @@ function playdate.update()
             currentContent = nil
         else
             print("Using parser:", fetchParser.name or "unknown")
-            print("---- HTML START ----")
-            print(fetchHTML)
-            print("---- HTML END ----")
-            local content, parseErr = fetchParser.parse(fetchHTML, fetchURL)
-            if not content then
-                statusMessage = "Error: " .. (parseErr or "Parse failed")
-                currentContent = nil
-                preparePageImage(nil)
-                resetViewToTop()
-            else
-                currentContent = content
-                currentURL = fetchURL
-                statusMessage = "Loaded " .. #content .. " elements"
-                preparePageImage(currentContent)
-                resetViewToTop()
+            if dumpFetchedHTML then
+                print("---- HTML START ----")
+                print(fetchHTML)
+                print("---- HTML END ----")
             end
+            startParse(fetchParser, fetchHTML, fetchURL)
         end
 
         hoveredButton = nil
@@ -485,10 +815,10 @@ function playdate.update()
         fetchParser = nil
     elseif fetchState == "error" then
         fetchState = nil
-        statusMessage = "Error: " .. (fetchError or "Unknown error")
-        currentContent = nil
-        preparePageImage(nil)
-        resetViewToTop()
+        -- Show the cached copy, if any, when the page can't be fetched
+        if not (fetchURL and startCachedLayout(fetchURL, "offline")) then
+            showLoadError(fetchError or "Unknown error")
+        end
 
         -- Clean up
         fetchHTML = ""
@@ -497,7 +827,10 @@ function playdate.update()
         fetchError = nil
     end
 
+    scheduler.update(taskBudgetMs)
+
     renderContent()
+    gcPolicy.drawStats()
 
     -- Handle input
     local crankChange = playdate.getCrankChange()
@@ -507,10 +840,11 @@ function playdate.update()
 
     -- Button controls
     if playdate.buttonJustPressed(playdate.kButtonB) then
-        if pageImage and #historyStack > 0 then
+        if pageLines and #historyStack > 0 then
             local previousURL = table.remove(historyStack)
-            pageImage = nil
+            clearPage()
             pendingURL = previousURL
+            pendingFromCache = true
         end
     end
 
@@ -522,12 +856,30 @@ function playdate.update()
                 if currentURL then
                     table.insert(historyStack, currentURL)
                 end
-                pageImage = nil
+                clearPage()
                 pendingURL = targetURL
                 print("Following link:", targetURL)
             end
         end
     end
+
+    gcPolicy.update(crankChange ~= 0)
+end
+
+-- Keep text measurements across launches
+measureCache.load()
+
+gcPolicy.set(gcPolicy.modeRead)
+playdate.getSystemMenu():addCheckmarkMenuItem("GC stats", false, function(show)
+    gcPolicy.setShowStats(show)
+end)
+
+function playdate.gameWillTerminate()
+    measureCache.save()
+end
+
+function playdate.deviceWillSleep()
+    measureCache.save()
 end
 
 -- Enable networking and load page automatically
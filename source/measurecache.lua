@@ -0,0 +1,79 @@
+-- Text measurement cache
+-- Remembers word-wrap results (see linebreak.lua) keyed by font, wrap width
+-- and a hash of the text, so laying out a page again (reloads, back
+-- navigation, cached pages) skips measuring. The text itself lives in the
+-- page cache; the key adds its length to the hash to rule out most
+-- collisions, which would otherwise give a paragraph another one's breaks.
+
+local pageCache = import "pagecache"
+
+local MeasureCache = {}
+
+local storeName = pageCache.directory .. "/measurecache"
+local formatVersion = 3
+local maxEntries = 1000
+
+local buckets = {}
+local entryCount = 0
+
+local function getBucket(fontKey, width, create)
+    local key = fontKey .. "@" .. width
+    local bucket = buckets[key]
+    if not bucket and create then
+        bucket = {}
+        buckets[key] = bucket
+    end
+    return bucket
+end
+
+local function textKey(text)
+    return string.format("%08x:%d", pageCache.hash(text), #text)
+end
+
+function MeasureCache.get(fontKey, width, text)
+    local bucket = getBucket(fontKey, width, false)
+    return bucket and bucket[textKey(text)]
+end
+
+function MeasureCache.put(fontKey, width, text, value)
+    local bucket = getBucket(fontKey, width, true)
+    local key = textKey(text)
+    if bucket[key] == nil then
+        if entryCount >= maxEntries then
+            MeasureCache.clear()
+            bucket = getBucket(fontKey, width, true)
+        end
+        entryCount += 1
+    end
+    bucket[key] = value
+end
+
+function MeasureCache.clear()
+    buckets = {}
+    entryCount = 0
+end
+
+function MeasureCache.save()
+    playdate.file.mkdir(pageCache.directory)
+    playdate.datastore.write({
+        version = formatVersion,
+        buckets = buckets
+    }, storeName)
+end
+
+function MeasureCache.load()
+    local stored = playdate.datastore.read(storeName)
+    if not stored or stored.version ~= formatVersion or type(stored.buckets) ~= "table" then
+        return
+    end
+
+    MeasureCache.clear()
+    for key, bucket in pairs(stored.buckets) do
+        buckets[key] = bucket
+        for _ in pairs(bucket) do
+            entryCount += 1
+        end
+    end
+end
+
+return MeasureCache
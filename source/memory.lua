@@ -0,0 +1,86 @@
+-- Memory pressure monitor
+-- Compares the Lua heap against a soft and a hard limit once per frame and
+-- asks registered handlers to drop whatever they can regenerate later.
+
+local Memory = {}
+
+Memory.levelNone = 0
+Memory.levelLow = 1
+Memory.levelCritical = 2
+
+Memory.softLimitKB = 6 * 1024
+Memory.hardLimitKB = 10 * 1024
+
+-- Heap growth needed before handlers run again at the same level
+local relieveMarginKB = 512
+
+-- Collector work done per frame while garbage is being cleared gradually
+local collectStepKB = 64
+local pendingCollectSteps = 0
+
+local handlers = {}
+local lastLevel = Memory.levelNone
+local lastRelievedKB = 0
+
+function Memory.usedKB()
+    return collectgarbage("count")
+end
+
+function Memory.level()
+    local used = collectgarbage("count")
+    if used >= Memory.hardLimitKB then
+        return Memory.levelCritical
+    elseif used >= Memory.softLimitKB then
+        return Memory.levelLow
+    end
+    return Memory.levelNone
+end
+
+-- handler(level) is called whenever memory runs low
+function Memory.onPressure(handler)
+    table.insert(handlers, handler)
+end
+
+function Memory.relieve(level)
+    for _, handler in ipairs(handlers) do
+        handler(level)
+    end
+
+    if level >= Memory.levelCritical then
+        collectgarbage("collect")
+    else
+        collectgarbage("step")
+    end
+
+    lastLevel = level
+    lastRelievedKB = collectgarbage("count")
+end
+
+-- A job just dropped a lot of data (a page's HTML and DOM): collect it a
+-- step per frame over the next few frames rather than in one long pause
+-- or whenever the collector gets to it
+function Memory.collectGradually(frames)
+    pendingCollectSteps = math.max(pendingCollectSteps, frames)
+end
+
+-- Check the heap and relieve pressure if it crossed a threshold since the
+-- last time; returns the current level, and whether handlers were run
+function Memory.update()
+    if pendingCollectSteps > 0 then
+        pendingCollectSteps -= 1
+        if collectgarbage("step", collectStepKB) then
+            pendingCollectSteps = 0 -- finished a cycle
+        end
+    end
+
+    local level = Memory.level()
+    if level == Memory.levelNone then
+        lastLevel = level
+    elseif level > lastLevel or collectgarbage("count") > lastRelievedKB + relieveMarginKB then
+        Memory.relieve(level)
+        return level, true
+    end
+    return level, false
+end
+
+return Memory
@@ -0,0 +1,218 @@
+-- Page cache
+-- Keeps the element list of each laid out page on disk, one file per URL,
+-- in a line-oriented format in the spirit of Gemini's gemtext:
+--
+--   #exo-page 1          header: format version
+--   #url <url>           the page's URL (file names are hashes of it)
+--   #coverage 0.42       share of the HTML read, when parsing was cut short
+--   #skimmed             parsing skipped optional subtrees
+--   => <url> <label>     button
+--   ~ <size>             spacer ("~" alone for the default size)
+--   <text>               paragraph; a leading "=", "~", "#" or "\" is
+--                        escaped with "\"
+--
+-- A cached page is read back in fixed-size chunks and handed out one
+-- element at a time, so loading it builds no element tables.
+
+local PageCache = {}
+
+local directory = "pages"
+PageCache.directory = directory
+local formatVersion = 1
+local header = "#exo-page " .. formatVersion
+local maxPages = 32
+local chunkSize = 4096
+
+local find, sub, byte, gsub = string.find, string.sub, string.byte, string.gsub
+
+-- 32-bit FNV-1a hash of a string
+function PageCache.hash(s)
+    local hash = 2166136261
+    for i = 1, #s do
+        hash = ((hash ~ byte(s, i)) * 16777619) & 0xffffffff
+    end
+    return hash
+end
+
+-- The URL stored in the file settles hash collisions
+local function pathFor(url)
+    return string.format("%s/%08x.gmi", directory, PageCache.hash(url))
+end
+
+-- Text and labels are single lines already; this only guards the format
+local function oneLine(text)
+    return (gsub(text, "[\r\n]", " "))
+end
+
+-- Drop the least recently written pages beyond maxPages
+local function evict()
+    local files = {}
+    for _, name in ipairs(playdate.file.listFiles(directory) or {}) do
+        if name:match("%.gmi$") then
+            files[#files + 1] = name
+        end
+    end
+    if #files <= maxPages then
+        return
+    end
+
+    local written = {}
+    for _, name in ipairs(files) do
+        local modTime = playdate.file.getModTime(directory .. "/" .. name)
+        written[name] = modTime and playdate.epochFromTime(modTime) or 0
+    end
+    table.sort(files, function(a, b)
+        return written[a] < written[b]
+    end)
+    for i = 1, #files - maxPages do
+        playdate.file.delete(directory .. "/" .. files[i])
+    end
+end
+
+-- Write a parsed element list (with its coverage and skimmed flags) as the
+-- cached copy of url. Returns false and a message if the file can't be written.
+function PageCache.save(url, elements)
+    playdate.file.mkdir(directory)
+    local path = pathFor(url)
+    local partial = path .. ".part"
+    local file, openErr = playdate.file.open(partial, playdate.file.kFileWrite)
+    if not file then
+        return false, openErr
+    end
+
+    local pieces = {header, "\n#url ", oneLine(url), "\n"}
+    if elements.coverage and elements.coverage < 1 then
+        pieces[#pieces + 1] = string.format("#coverage %.3f\n", elements.coverage)
+    end
+    if elements.skimmed then
+        pieces[#pieces + 1] = "#skimmed\n"
+    end
+
+    local size = 0
+    local function put(s)
+        pieces[#pieces + 1] = s
+        size += #s
+        if size >= chunkSize then
+            file:write(table.concat(pieces))
+            pieces, size = {}, 0
+        end
+    end
+
+    for _, element in ipairs(elements) do
+        if element.kind == "spacer" then
+            put(element.size and ("~ " .. element.size .. "\n") or "~\n")
+        elseif element.kind == "button" then
+            put("=> " .. gsub(oneLine(element.url or ""), " ", "%%20") .. " "
+                .. oneLine(element.label or element.content or "Link") .. "\n")
+        else
+            local text = oneLine(element.content or "")
+            if find(text, "^[=~#\\]") then
+                text = "\\" .. text
+            end
+            put(text .. "\n")
+        end
+    end
+    file:write(table.concat(pieces))
+    file:close()
+
+    playdate.file.delete(path)
+    playdate.file.rename(partial, path)
+    evict()
+    return true
+end
+
+-- Read a file a chunk at a time; returns a function giving its next line,
+-- or nil at the end
+local function lineReader(file)
+    local buffer, pos = "", 1
+    local done = false
+    return function()
+        while true do
+            local newline = find(buffer, "\n", pos, true)
+            if newline then
+                local line = sub(buffer, pos, newline - 1)
+                pos = newline + 1
+                return line
+            end
+            if done then
+                if pos <= #buffer then
+                    local line = sub(buffer, pos)
+                    pos = #buffer + 1
+                    return line
+                end
+                return nil
+            end
+            local chunk = file:read(chunkSize)
+            if not chunk or #chunk == 0 then
+                done = true
+                file:close()
+            else
+                buffer, pos = sub(buffer, pos) .. chunk, 1
+            end
+        end
+    end
+end
+
+function PageCache.has(url)
+    return playdate.file.exists(pathFor(url))
+end
+
+-- Open the cached copy of url. Returns a function giving the next element's
+-- kind and fields ("text", content / "spacer", size / "button", label, url;
+-- nil at the end), a function giving the share of the file read so far, and
+-- the page's {coverage, skimmed}. Returns nil if the page isn't cached.
+function PageCache.open(url)
+    local path = pathFor(url)
+    local fileSize = playdate.file.getSize(path)
+    local file = fileSize and playdate.file.open(path, playdate.file.kFileRead)
+    if not file then
+        return nil
+    end
+
+    local nextLine = lineReader(file)
+    if nextLine() ~= header or nextLine() ~= "#url " .. oneLine(url) then
+        file:close()
+        return nil
+    end
+
+    local info = {}
+    local bytesRead = 0
+    local line = nextLine()
+    while line and byte(line, 1) == 35 do -- "#"
+        local coverage = line:match("^#coverage (%S+)")
+        if coverage then
+            info.coverage = tonumber(coverage)
+        elseif line == "#skimmed" then
+            info.skimmed = true
+        end
+        line = nextLine()
+    end
+
+    local function nextElement()
+        if not line then
+            return nil
+        end
+        local current = line
+        bytesRead += #current + 1
+        line = nextLine()
+
+        local first = byte(current, 1)
+        if first == 61 and byte(current, 2) == 62 then -- "=>"
+            local link, label = current:match("^=> (%S*) ?(.*)$")
+            return "button", label ~= "" and label or "Link", link
+        elseif first == 126 then -- "~"
+            return "spacer", tonumber(sub(current, 3))
+        elseif first == 92 then -- "\"
+            return "text", sub(current, 2)
+        end
+        return "text", current
+    end
+
+    local function progress()
+        return bytesRead / math.max(fileSize, 1)
+    end
+
+    return nextElement, progress, info
+end
+
+return PageCache
@@ -0,0 +1,77 @@
+-- Cooperative scheduler
+-- Runs long jobs (parsing, layout) as coroutines and resumes them every
+-- frame until a time budget is spent, so input and drawing keep going.
+-- A task gives up the frame by calling Scheduler.checkpoint(), or by
+-- yielding directly; a number yielded is taken as its progress (0 to 1).
+
+local Scheduler = {}
+
+local tasks = {}
+local current = nil
+local deadline = 0
+
+-- Queue fn to run as a task; onDone(ok, ...) receives what fn returned, or
+-- false and the error message if it failed
+function Scheduler.spawn(name, fn, onDone)
+    local task = {
+        name = name,
+        progress = 0,
+        routine = coroutine.create(fn),
+        onDone = onDone
+    }
+    table.insert(tasks, task)
+    return task
+end
+
+function Scheduler.cancel(task)
+    for i, queued in ipairs(tasks) do
+        if queued == task then
+            table.remove(tasks, i)
+            return
+        end
+    end
+end
+
+-- The task that will run next, if any
+function Scheduler.activeTask()
+    return tasks[1]
+end
+
+-- Called from inside a task: record progress and yield once the frame's
+-- budget is spent. Does nothing outside a scheduled task.
+function Scheduler.checkpoint(progress)
+    if not current then
+        return
+    end
+    if progress then
+        current.progress = progress
+    end
+    if coroutine.isyieldable() and playdate.getCurrentTimeMilliseconds() >= deadline then
+        coroutine.yield()
+    end
+end
+
+function Scheduler.update(budgetMs)
+    deadline = playdate.getCurrentTimeMilliseconds() + budgetMs
+
+    while tasks[1] and playdate.getCurrentTimeMilliseconds() < deadline do
+        local task = tasks[1]
+        current = task
+        local results = table.pack(coroutine.resume(task.routine))
+        current = nil
+
+        if coroutine.status(task.routine) == "dead" then
+            Scheduler.cancel(task)
+            if not results[1] then
+                print("Task failed:", task.name, results[2])
+            end
+            if task.onDone then
+                task.onDone(table.unpack(results, 1, results.n))
+            end
+        elseif type(results[2]) == "number" then
+            task.progress = results[2]
+        end
+    end
+end
+
+return Scheduler
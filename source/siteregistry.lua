@@ -0,0 +1,96 @@
+-- Site parser registry
+-- Sites register the host they serve and a URL pattern. A lookup goes
+-- straight to the sites for the URL's host and only tries their patterns,
+-- so the cost does not grow with the number of curated sites.
+--
+-- A site either carries its parse function or names a module in sites/
+-- that is compiled into the pdx but only run the first time one of its
+-- sites is used. Module entries are declarative rules (see siterules.lua)
+-- compiled on load, or parse functions; a module may also return a
+-- function, which is called with the helpers in siteutils.lua. Loaded
+-- modules are dropped again under memory pressure.
+
+local memory = import "memory"
+local siteUtils = import "siteutils"
+local siteRules = import "siterules"
+
+local SiteRegistry = {}
+
+local sitesByHost = {}
+local loadedModules = {}
+
+function SiteRegistry.hostOf(url)
+    local host = string.match(url or "", "^%a[%w+.-]*://([^/?#:]+)")
+    return host and string.lower(host)
+end
+
+-- Add a site: {name = ..., host = ..., pattern = ..., parse = function(html, url)},
+-- or with module = "sites/<file>" and entry = "<function name>" instead of parse
+function SiteRegistry.register(site)
+    assert(type(site.host) == "string", "site needs a host")
+    assert(type(site.pattern) == "string", "site needs a URL pattern")
+    assert(site.parse or site.module, "site needs a parse function or module")
+
+    local host = string.lower(site.host)
+    local sites = sitesByHost[host]
+    if not sites then
+        sites = {}
+        sitesByHost[host] = sites
+    end
+    table.insert(sites, site)
+    return site
+end
+
+-- The first site registered for the URL's host whose pattern matches it
+function SiteRegistry.find(url)
+    local sites = sitesByHost[SiteRegistry.hostOf(url)]
+    if not sites then
+        return nil
+    end
+
+    for _, site in ipairs(sites) do
+        if string.match(url, site.pattern) then
+            return site
+        end
+    end
+    return nil
+end
+
+-- The parse function for a site, loading its module if needed
+function SiteRegistry.load(site)
+    if site.parse then
+        return site.parse
+    end
+
+    local module = loadedModules[site.module]
+    if not module then
+        module = playdate.file.run(site.module)
+        if type(module) == "function" then
+            module = module(siteUtils)
+        end
+        loadedModules[site.module] = module
+    end
+
+    local parse = module[site.entry]
+    assert(parse, "site module " .. site.module .. " has no " .. tostring(site.entry))
+    if type(parse) == "table" then
+        parse = siteRules.compile(parse)
+        module[site.entry] = parse
+    end
+    return parse
+end
+
+function SiteRegistry.parse(site, html, url)
+    return SiteRegistry.load(site)(html, url)
+end
+
+-- Forget loaded site modules; they are run again on next use
+function SiteRegistry.unload()
+    loadedModules = {}
+end
+
+memory.onPressure(function()
+    SiteRegistry.unload()
+end)
+
+return SiteRegistry
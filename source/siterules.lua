@@ -0,0 +1,229 @@
+-- Declarative site rules
+-- A site describes what to show instead of how to find it:
+--
+--   {
+--       container = {"article#article", "article"}, -- first match scopes the rules (":root" = whole page)
+--       ignore = {"nav", "footer", ".ad"}, -- elements ("tag", "#id" or ".class") whose content isn't parsed
+--       rules = {
+--           {select = "h2", role = "title", limit = 1},
+--           {select = "p", role = "meta", limit = 2, stop = "[class*=\"segment\"]"},
+--           {spacer = 8},
+--           {select = ".body p", role = "paragraph", leaf = true, fallback = "p"},
+--           {select = "li a", role = "link", label = "Read more", spacing = 8}
+--       }
+--   }
+--
+-- Roles: "title" (bold), "meta" and "paragraph" (plain text) and "link"
+-- (text plus a button to the node's href). A rule can instead add fixed
+-- `text` or a `spacer`. Options: `style` ("bold"/"italic") overrides the
+-- role's style, `limit` caps the items added, `spacing` adds a spacer after
+-- each item, `leaf` keeps only nodes without child elements, `stop` ends
+-- the rule at the first node matching that selector, and `fallback` is a
+-- selector (or a whole rule) used when `select` finds nothing. A node is
+-- shown at most once, by the first rule that adds it.
+--
+-- SiteRules.compile turns a description into a parse(html, url) function
+-- once, when the site is loaded. Every selector the rules use is gathered
+-- into one list, so a page is queried with a single walk of the container,
+-- and the parser only keeps the attributes those selectors read.
+
+local ElementNode = import "ElementNode"
+local siteUtils = import "siteutils"
+
+local SiteRules = {}
+
+local extractText = siteUtils.extractText
+local addText = siteUtils.addText
+local addSpacer = siteUtils.addSpacer
+local addButton = siteUtils.addButton
+
+local styles = {
+    plain = function(text) return text end,
+    bold = function(text) return "*" .. text .. "*" end,
+    italic = function(text) return "_" .. text .. "_" end
+}
+
+local roleStyles = {
+    title = "bold",
+    meta = "plain",
+    paragraph = "plain",
+    link = "plain"
+}
+
+local compileRule
+
+-- An adder(elements, text, node) for the rule's role
+local function compileRole(rule)
+    local style = styles[rule.style or roleStyles[rule.role] or "plain"]
+    assert(style, "unknown style " .. tostring(rule.style))
+    local spacing = rule.spacing
+
+    if rule.role == "link" then
+        local label = rule.label or "Read more"
+        return function(elements, text, node)
+            addText(elements, style(text))
+            addButton(elements, label, node:getattribute("href"))
+            if spacing then
+                addSpacer(elements, spacing)
+            end
+        end
+    end
+
+    assert(roleStyles[rule.role], "unknown role " .. tostring(rule.role))
+    return function(elements, text)
+        addText(elements, style(text))
+        if spacing then
+            addSpacer(elements, spacing)
+        end
+    end
+end
+
+local function compileSelectRule(rule, query)
+    local selected = query(rule.select)
+    local add = compileRole(rule)
+    local limit = rule.limit
+    local leaf = rule.leaf
+    local stop = rule.stop and query(rule.stop)
+
+    local fallback = nil
+    if type(rule.fallback) == "string" then
+        local alternative = {}
+        for k, v in pairs(rule) do
+            alternative[k] = v
+        end
+        alternative.select = rule.fallback
+        alternative.fallback = nil
+        fallback = compileRule(alternative, query)
+    elseif rule.fallback then
+        fallback = compileRule(rule.fallback, query)
+    end
+
+    return function(found, elements, shown)
+        local nodes = found[selected]
+        if #nodes == 0 then
+            if fallback then
+                fallback(found, elements, shown)
+            end
+            return
+        end
+
+        local stopNodes = nil
+        if stop then
+            stopNodes = {}
+            for _, node in ipairs(found[stop]) do
+                stopNodes[node] = true
+            end
+        end
+
+        local count = 0
+        for _, node in ipairs(nodes) do
+            if stopNodes and stopNodes[node] then
+                break
+            end
+            if not shown[node] and (not leaf or not node:haschildren()) then
+                local text = extractText(node)
+                if text then
+                    shown[node] = true
+                    add(elements, text, node)
+                    count += 1
+                    if limit and count >= limit then
+                        break
+                    end
+                end
+            end
+        end
+    end
+end
+
+-- `query(selector)` returns the index of the selector's results in the
+-- list the rule is handed at parse time
+compileRule = function(rule, query)
+    if rule.spacer then
+        local size = rule.spacer
+        return function(_, elements)
+            addSpacer(elements, size)
+        end
+    elseif rule.text then
+        local text = styles[rule.style or roleStyles[rule.role] or "plain"](rule.text)
+        return function(_, elements)
+            addText(elements, text)
+        end
+    end
+
+    assert(rule.select, "rule needs select, text or spacer")
+    return compileSelectRule(rule, query)
+end
+
+-- Build the parse(html, url) function for a site description
+function SiteRules.compile(description)
+    local containers = description.container or {":root"}
+    if type(containers) == "string" then
+        containers = {containers}
+    end
+
+    local selectors = {}
+    local indexes = {}
+    local function query(selector)
+        if not indexes[selector] then
+            table.insert(selectors, selector)
+            indexes[selector] = #selectors
+        end
+        return indexes[selector]
+    end
+
+    local rules = {}
+    for i, rule in ipairs(description.rules) do
+        rules[i] = compileRule(rule, query)
+    end
+
+    local ignore = description.ignore or {}
+    local attributes = {href = true} -- read by link buttons
+    for _, list in ipairs({containers, selectors, ignore}) do
+        for _, selector in ipairs(list) do
+            if selector ~= ":root" then
+                ElementNode.selectorattributes(selector, attributes)
+            end
+        end
+    end
+    local parseOptions = {attributes = attributes, ignore = ignore}
+
+    return function(html)
+        local root = siteUtils.parseDocument(html, parseOptions)
+        if not root then
+            return nil, "Failed to parse HTML"
+        end
+
+        local container = nil
+        for _, selector in ipairs(containers) do
+            container = selector == ":root" and root or root:selectFirst(selector)
+            if container then
+                break
+            end
+        end
+        if not container then
+            return nil, "No content container"
+        end
+
+        local found = container:selectMany(selectors)
+        local elements = {}
+        local shown = {}
+        for _, rule in ipairs(rules) do
+            rule(found, elements, shown)
+        end
+
+        if #elements == 0 then
+            return nil, "No recognizable content"
+        end
+
+        -- Less than 1 when the parser ran out of budget before the end
+        elements.coverage = root.coverage
+        elements.skimmed = root.skimmed
+        if root.coverage < 1 then
+            addSpacer(elements, 8)
+            addText(elements, styles.italic("Page cut short: only " .. math.floor(root.coverage * 100) .. "% of it was read"))
+        end
+        return elements
+    end
+end
+
+return SiteRules
@@ -0,0 +1,29 @@
+-- CBC Lite (www.cbc.ca/lite)
+-- Loaded by the site registry on first use; see siteparsers.lua.
+
+return {
+    frontpage = {
+        ignore = {"nav", "footer", "svg"},
+        rules = {
+            {text = "CBC Lite", role = "title"},
+            {text = " "},
+            {select = "a.contentlist_title__GRPR1[href*=\"lite\"]", role = "link", spacing = 6}
+        }
+    },
+
+    article = {
+        container = {"article#article", "article"},
+        ignore = {"nav", "footer", "svg"},
+        rules = {
+            {select = "h2", role = "title", limit = 1},
+            {select = "p", role = "meta", limit = 2, stop = "[class*=\"article_segment__\"]"},
+            {spacer = 8},
+            {
+                select = "[class*=\"article_segment__aglub\"]",
+                role = "paragraph",
+                leaf = true,
+                fallback = {select = "p:not([class*=\"embed\"]):not([class*=\"related\"])", role = "paragraph"}
+            }
+        }
+    }
+}
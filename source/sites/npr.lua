@@ -0,0 +1,24 @@
+-- NPR text-only site (text.npr.org)
+-- Loaded by the site registry on first use; see siteparsers.lua.
+
+return {
+    frontpage = {
+        ignore = {"header", "nav", "footer"},
+        rules = {
+            {select = ".topic-heading", fallback = "h1", role = "title", limit = 1},
+            {select = ".topic-date", role = "meta", style = "italic", limit = 1, spacing = 8},
+            {select = ".topic-container li a", role = "link", spacing = 8}
+        }
+    },
+
+    article = {
+        container = {"article .story-container", ":root"},
+        ignore = {"header", "nav", "footer"},
+        rules = {
+            {select = ".story-title", fallback = "h1", role = "title", limit = 1},
+            {select = ".story-head p", role = "meta"},
+            {spacer = 10},
+            {select = ".paragraphs-container p", role = "paragraph"}
+        }
+    }
+}
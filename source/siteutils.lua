@@ -0,0 +1,78 @@
+-- Helpers shared by the site modules in sites/
+-- Site modules are loaded on demand by the registry and receive this table,
+-- so they need no imports of their own.
+
+local htmlparser = import "htmlparser"
+local memory = import "memory"
+local scheduler = import "scheduler"
+local textClean = import "textclean"
+
+local SiteUtils = {}
+
+-- Visible text of a node, assembled from the text spans the tokenizer
+-- recorded, without copying the node's raw HTML first
+function SiteUtils.extractText(node)
+    if not node or not node.textspans then
+        return nil
+    end
+
+    local text, starts, ends, first, last = node:textspans()
+    local buffer = textClean.newBuffer()
+    for i = first, last do
+        textClean.append(buffer, text, starts[i], ends[i])
+    end
+    return textClean.finish(buffer)
+end
+
+function SiteUtils.addText(elements, text)
+    if text and #text > 0 then
+        table.insert(elements, {
+            kind = "text",
+            content = text
+        })
+    end
+end
+
+function SiteUtils.addSpacer(elements, size)
+    table.insert(elements, {
+        kind = "spacer",
+        size = size or 8
+    })
+end
+
+function SiteUtils.addButton(elements, label, url)
+    if label and #label > 0 and url and #url > 0 then
+        table.insert(elements, {
+            kind = "button",
+            label = label,
+            url = url
+        })
+    end
+end
+
+-- Parsing stops after this much work, or when the heap reaches the memory
+-- monitor's hard limit; root.coverage then tells how much of the page was read
+SiteUtils.parseTimeBudgetMs = 10000
+
+-- Parse a document a slice at a time, giving the frame back in between.
+-- `options` are passed on to the parser (attributes to keep, subtrees to
+-- ignore, budgets); budgets not given default to the ones above.
+function SiteUtils.parseDocument(html, options)
+    local parseOptions = {}
+    for k, v in pairs(options or {}) do
+        parseOptions[k] = v
+    end
+    parseOptions.timebudget = parseOptions.timebudget or SiteUtils.parseTimeBudgetMs
+    parseOptions.memorylimit = parseOptions.memorylimit or memory.hardLimitKB
+
+    local step = htmlparser.parser(html, nil, parseOptions)
+    while true do
+        local root, progress = step()
+        if root then
+            return root
+        end
+        scheduler.checkpoint(progress)
+    end
+end
+
+return SiteUtils
@@ -0,0 +1,153 @@
+-- Text normalizer
+-- Turns raw HTML text into a display string in a single scan: strips tags,
+-- decodes entities, folds em-dashes, and collapses and trims whitespace.
+-- Output is gathered in a buffer of pieces so several ranges of the same
+-- document can be cleaned into one string with a single concatenation.
+
+local entities = import "entities"
+
+local TextClean = {}
+
+local find, sub, byte, gsub = string.find, string.sub, string.byte, string.gsub
+
+-- The most common entities, plus every other one decoded so far; the rest
+-- are looked up in the full table (entities.lua) on first use
+local namedEntities = {
+    nbsp = " ",
+    amp = "&",
+    lt = "<",
+    gt = ">",
+    quot = "\"",
+    apos = "'"
+}
+
+-- Characters the display font can't draw, replaced wherever they come from
+local emDash = "\226\128\148"
+local emDashReplacement = "-"
+
+local function decodeEntity(name)
+    local decoded = namedEntities[name]
+    if decoded then
+        return decoded
+    end
+
+    if byte(name, 1) ~= 35 then -- named reference
+        decoded = entities.decode(name)
+        if decoded == emDash then
+            decoded = emDashReplacement
+        end
+        namedEntities[name] = decoded
+        return decoded
+    end
+
+    local codepoint
+    local hex = string.match(name, "^#[xX](%x+)$")
+    if hex then
+        codepoint = tonumber(hex, 16)
+    else
+        local decimal = string.match(name, "^#(%d+)$")
+        codepoint = decimal and tonumber(decimal)
+    end
+    if codepoint and codepoint > 0 and codepoint <= 0x10FFFF then
+        decoded = utf8.char(codepoint)
+        return decoded == emDash and emDashReplacement or decoded
+    end
+
+    return nil
+end
+
+function TextClean.newBuffer()
+    return {n = 0, space = false}
+end
+
+-- Add literal text to the buffer, merging its spaces with the pending one
+local function emit(buffer, piece)
+    if find(piece, "  ", 1, true) then
+        piece = gsub(piece, " +", " ")
+    end
+
+    local leading = byte(piece, 1) == 32
+    local trailing = byte(piece, -1) == 32
+    if leading or trailing then
+        piece = sub(piece, leading and 2 or 1, trailing and -2 or -1)
+    end
+
+    if #piece == 0 then
+        buffer.space = buffer.space or leading or trailing
+        return
+    end
+
+    local n = buffer.n
+    if (leading or buffer.space) and n > 0 then
+        n += 1
+        buffer[n] = " "
+    end
+    n += 1
+    buffer[n] = piece
+    buffer.n = n
+    buffer.space = trailing
+end
+
+-- Clean s[i..j] into the buffer. Everything except single spaces and plain
+-- characters is found by one pattern, so ordinary text is copied in long
+-- runs rather than character by character.
+function TextClean.append(buffer, s, i, j)
+    i = i or 1
+    j = j or #s
+    local pos = i
+
+    while pos <= j do
+        local special = find(s, "[%c<&\226]", pos)
+        if not special or special > j then
+            emit(buffer, sub(s, pos, j))
+            break
+        end
+        if special > pos then
+            emit(buffer, sub(s, pos, special - 1))
+        end
+
+        local c = byte(s, special)
+        pos = special + 1
+        if c == 60 then -- "<": skip the tag, or keep a stray "<"
+            local close = find(s, ">", special + 1, true)
+            if close and close <= j then
+                pos = close + 1
+            else
+                emit(buffer, "<")
+            end
+        elseif c == 38 then -- "&": decode the entity, or keep a stray "&"
+            local _, stop, name = find(s, "^&(#?%w+);", special)
+            local decoded = stop and stop <= j and decodeEntity(name)
+            if decoded and find(decoded, "^%s+$") then
+                buffer.space = true
+                pos = stop + 1
+            elseif decoded then
+                emit(buffer, decoded)
+                pos = stop + 1
+            else
+                emit(buffer, "&")
+            end
+        elseif c == 226 then -- possible em-dash
+            if special + 2 <= j and sub(s, special, special + 2) == emDash then
+                emit(buffer, emDashReplacement)
+                pos = special + 3
+            else
+                emit(buffer, "\226")
+            end
+        else -- control characters (tabs, newlines) count as whitespace
+            buffer.space = true
+        end
+    end
+
+    return buffer
+end
+
+-- The cleaned string, or nil if nothing visible was added
+function TextClean.finish(buffer)
+    if buffer.n == 0 then
+        return nil
+    end
+    return table.concat(buffer, "", 1, buffer.n)
+end
+
+return TextClean